@@ -6,12 +6,29 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(_MSC_VER)
 #include <malloc.h>
 #define alloca _alloca
+#else
+#include <fcntl.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* -DFFI_JIT enables the callback thunks (see FFI closure) on x86-64 SysV */
+#if defined(FFI_JIT) && defined(__x86_64__) && !defined(_WIN32)
+#define FFI_JIT_X64
+#include <sys/mman.h>
 #endif
 
 #define INT_TYPE_LIST_(macro) \
@@ -29,12 +46,158 @@
 	macro(FFI_TYPE_DOUBLE, double, double) \
 	macro(FFI_TYPE_LONGDOUBLE, long double, longdouble)
 
+/** Metatables
+ *
+ * Each metatable is stored in the registry with a light userdata key, the
+ * address of its name, and holds that same key mapped to true.  Checking
+ * the type of a userdata is then a pointer-keyed lookup in its own
+ * metatable, without going through the registry by string name.
+ *
+ * The first state to open the library also caches the addresses of its
+ * metatables, so that most checks are a pointer comparison.  The cache is
+ * cleared when that state is closed; other states, and the variant
+ * metatables made by memory tracking, take the lookup path.
+ */
+
+static const char tags_[][16] = {
+	"ffi_cif", "ffi_type", "ffi_obj", "ffi_closure",
+	"ffi_stream", "ffi_ptrarg", "ffi_frozen", "ffi_view",
+	"ffi_anchor", "ffi_array", "ffi_uarray", "ffi_memstats",
+	"ffi_pipeline", "ffi_cursor", "ffi_buffer", "ffi_channel",
+	"ffi_bind", "ffi_memo", "ffi_bufviews",
+};
+
+#define cif_tag tags_[0]
+#define type_tag tags_[1]
+#define obj_tag tags_[2]
+#define closure_tag tags_[3]
+#define stream_tag tags_[4]
+#define ptrarg_tag tags_[5]
+#define frozen_tag tags_[6]
+#define view_tag tags_[7]
+#define anchor_tag tags_[8]
+#define array_tag tags_[9]
+#define uarray_tag tags_[10]
+#define memstats_tag tags_[11]
+#define pipeline_tag tags_[12]
+#define cursor_tag tags_[13]
+#define buffer_tag tags_[14]
+#define channel_tag tags_[15]
+#define bind_tag tags_[16]
+#define memo_tag tags_[17]
+#define bufviews_tag tags_[18]
+#define NTAGS 19
+
+static const void *_Atomic mtcache_[NTAGS];
+static _Atomic int mtcache_owned_;
+
+#define mtslot_(tag) (((const char (*)[16]) (tag)) - tags_)
+
+/* mtcache.__gc: the owning state is being closed */
+static
+int mtcache_gc(lua_State *L)
+{
+	int i;
+
+	for (i = 0; i < NTAGS; i++)
+		atomic_store(&mtcache_[i], NULL);
+	atomic_store(&mtcache_owned_, 0);
+	return 0;
+}
+
+/* Takes the metatable cache for this state, if no other state owns it */
+static
+int mtcache_own_(lua_State *L)
+{
+	int owned = 0;
+
+	if (!atomic_compare_exchange_strong(&mtcache_owned_, &owned, 1))
+		return 0;
+	lua_newuserdata(L, 1);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, mtcache_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, (void *) mtcache_);
+	return 1;
+}
+
+static
+void newmetatable_(lua_State *L, const char *tag)
+{
+	luaL_newmetatable(L, tag);
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, -2, tag);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, tag);
+}
+
+/* Returns the userdata at idx if its metatable carries tag, or NULL */
+static
+void *testudata_(lua_State *L, int idx, const char *tag)
+{
+	void *p = lua_touserdata(L, idx);
+
+	if (p == NULL || !lua_getmetatable(L, idx))
+		return NULL;
+	if (lua_topointer(L, -1) == atomic_load_explicit(&mtcache_[mtslot_(tag)],
+			memory_order_relaxed)) {
+		lua_pop(L, 1);
+		return p;
+	}
+	if (lua_rawgetp(L, -1, tag) == LUA_TNIL)
+		p = NULL;
+	lua_pop(L, 2);
+	return p;
+}
+
+static
+void *checkudata_(lua_State *L, int idx, const char *tag)
+{
+	void *p = testudata_(L, idx, tag);
+
+	/* luaL_checkudata raises the standard error message */
+	return (p != NULL) ? p : luaL_checkudata(L, idx, tag);
+}
+
+#define setmetatable_(L, tag) \
+	(lua_rawgetp(L, LUA_REGISTRYINDEX, (tag)), lua_setmetatable(L, -2))
+
+/* Accesses a userdata already known to be of the expected kind, e.g. the
+ * type stored as the uservalue of an object. */
+#define totype_(L, idx) ((ffi_type *) lua_touserdata(L, (idx)))
+#define tocif_(L, idx) ((ffi_cif *) lua_touserdata(L, (idx)))
+
+
 /* Callback from FFI */
 struct closure {
 	lua_State *L;
 	ffi_closure *closure;  /* released in __gc */
 	void *exec_addr;  /* FFI will call this address */
+	void *jit;  /* the thunk at exec_addr, if any, released in __gc */
 	int fn_ref;  /* a refernce in registry to the Lua closure */
+	int views_ref;  /* a reference to the types of argument views, if any */
+	unsigned nargs;
+	/* stores the return value, or NULL for void */
+	void (*rstore)(lua_State *L, void *ret, ffi_type *type);
+	/* followed by size_t viewsizes[nargs]: the sizes of arguments passed
+	 * as views, or 0 for other arguments; and by push_fn argpush[nargs]:
+	 * the functions that push the other arguments */
+};
+
+typedef void (*push_fn)(lua_State *L, void *addr, ffi_type *type);
+
+#define viewsizes_(cl) ((size_t *) ((cl) + 1))
+#define argpush_(cl) ((push_fn *) (viewsizes_(cl) + (cl)->nargs))
+
+/* Memory accounting categories */
+enum {
+	MEM_ALLOC,  /* alloc and array */
+	MEM_RETURN,  /* struct return values */
+	MEM_DEREF,  /* struct copies made by deref */
+	MEM_CLOSURE,  /* closures, including libFFI's part */
+	MEM_OTHER,  /* stream buffers, out-parameter storage */
+	MEM_NCAT
 };
 
 
@@ -87,7 +250,7 @@ void add_type(luaL_Buffer *B, ffi_type *type)
 static
 int type_tostr(lua_State *L)
 {
-	ffi_type *type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
 	luaL_Buffer B;
 
 	luaL_buffinit(L, &B);
@@ -104,7 +267,7 @@ int alignof_(lua_State *L)
 {
 	ffi_type *type;
 
-	type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
+	type = (ffi_type *) checkudata_(L, 1, type_tag);
 	lua_pushinteger(L, type->alignment);
 	return 1;
 }
@@ -135,7 +298,7 @@ int makestruct(lua_State *L)
 			accept_name = 0;
 			continue;
 		}
-		luaL_argcheck(L, luaL_testudata(L, -1, "ffi_type"), 1,
+		luaL_argcheck(L, testudata_(L, -1, type_tag), 1,
 			"expect a sequence of ffi_type");
 		lua_rawseti(L, 1, ++len);
 		accept_name = 1;
@@ -148,7 +311,7 @@ int makestruct(lua_State *L)
 	assert(len == lua_rawlen(L, 1));
 	type = (ffi_type *) lua_newuserdata(L, sizeof *type +
 		sizeof (ffi_type *) * (len+1) + sizeof offsets[0] * len);
-	luaL_setmetatable(L, "ffi_type");
+	setmetatable_(L, type_tag);
 	lua_pushvalue(L, 1);
 	lua_setuservalue(L, -2);
 	type->size = type->alignment = 0;
@@ -158,7 +321,7 @@ int makestruct(lua_State *L)
 	for (i = 0; i < len; i++) {
 		lua_rawgeti(L, 1, i+1);
 		type->elements[i] = (ffi_type *)
-			luaL_checkudata(L, -1, "ffi_type");
+			checkudata_(L, -1, type_tag);
 		lua_pop(L, 1);
 	}
 	type->elements[len] = NULL;
@@ -170,6 +333,40 @@ int makestruct(lua_State *L)
 	return 1;
 }
 
+/* Replaces the struct type at stack top with the type of its field named
+ * (or indexed) by the value at k.  Returns the offset of the field.
+ */
+static
+size_t field_(lua_State *L, int k)
+{
+	ffi_type *type = totype_(L, -1);
+	lua_Integer idx, len;
+	size_t *offsets;
+
+	luaL_argcheck(L, type->type == FFI_TYPE_STRUCT, 1,
+		"type is not a struct");
+	lua_getuservalue(L, -1);
+	len = lua_rawlen(L, -1);
+	offsets = (size_t *) &type->elements[len+1];
+	if (lua_type(L, k) == LUA_TSTRING) {
+		lua_pushvalue(L, k);
+		if (lua_rawget(L, -2) != LUA_TNUMBER) {
+			lua_pushfstring(L, "field '%s' undefined",
+				lua_tostring(L, k));
+			luaL_argerror(L, k, lua_tostring(L, -1));
+		}
+		idx = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	} else {
+		idx = luaL_checkinteger(L, k);
+	}
+	luaL_argcheck(L, 1 <= idx && idx <= len, k, "index out of bound");
+	lua_rawgeti(L, -1, idx);  /* type */
+	lua_replace(L, -3);  /* replace the struct type */
+	lua_pop(L, 1);  /* pop table */
+	return offsets[idx-1];
+}
+
 /* Gets the type and offset of a field.
  *
  * Args:
@@ -189,35 +386,11 @@ int getfield(lua_State *L)
 	if (top < 2) {
 		return luaL_error(L, "expect 2 arguments, got %d", top);
 	}
+	checkudata_(L, 1, type_tag);
+	lua_pushvalue(L, 1);
 	for (i = 2; i <= top; i++) {
-		lua_Integer idx, len;
-		size_t *offsets;
-		ffi_type *type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
-
-		luaL_argcheck(L, type->type == FFI_TYPE_STRUCT, 1,
-			"type is not a struct");
-		lua_getuservalue(L, 1);
-		luaL_argcheck(L, lua_istable(L, -1), 1, "ffi_type is corrupted");
-		len = lua_rawlen(L, -1);
-		offsets = (size_t *) &type->elements[len+1];
-		if (lua_type(L, i) == LUA_TSTRING) {
-			lua_pushvalue(L, i);
-			if (lua_rawget(L, -2) != LUA_TNUMBER) {
-				lua_pushfstring(L, "field '%s' undefined",
-					lua_tostring(L, i));
-				return luaL_argerror(L, i, lua_tostring(L, -1));
-			}
-			lua_replace(L, i);
-		}
-		idx = luaL_checkinteger(L, i);
-		luaL_argcheck(L, 1 <= idx && idx <= len, i, "index out of bound");
-		/* field table is at stack top */
-		lua_rawgeti(L, -1, idx);  /* type */
-		lua_copy(L, -1, 1);  /* replace argument #1 */
-		lua_pop(L, 2);  /* pop table and type */
-		offset += offsets[idx-1];
+		offset += field_(L, i);
 	}
-	lua_settop(L, 1);
 	lua_pushinteger(L, offset);
 	return 2;
 }
@@ -229,7 +402,7 @@ int getnfields(lua_State *L)
 	lua_Integer len;
 	ffi_type *type;
 
-	type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
+	type = (ffi_type *) checkudata_(L, 1, type_tag);
 	luaL_argcheck(L, type->type == FFI_TYPE_STRUCT, 1,
 		"type is not a struct");
 	lua_getuservalue(L, 1);
@@ -239,14 +412,371 @@ int getnfields(lua_State *L)
 	return 1;
 }
 
+/* Given the field table of a struct type at idx, pushes a table mapping
+ * field indexes to names (the inverse of its hash part).
+ */
+static
+void push_fieldnames_(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	lua_createtable(L, lua_rawlen(L, idx), 0);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING &&
+				lua_type(L, -1) == LUA_TNUMBER) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, -4, lua_tointeger(L, -2));
+		}
+		lua_pop(L, 1);
+	}
+}
+
 /* initializes object at stack top */
 static
 void initobj_(lua_State *L, int type_idx)
 {
-	luaL_setmetatable(L, "ffi_obj");
-	assert(luaL_testudata(L, type_idx, "ffi_type"));
+	setmetatable_(L, obj_tag);
+	assert(testudata_(L, type_idx, type_tag));
+	lua_pushvalue(L, type_idx);
+	lua_setuservalue(L, -2);
+}
+
+/** Views
+ *
+ * A view is an object over memory it does not hold: a struct view with
+ * metatable "ffi_view", whose uservalue is the type, like an ffi_obj.
+ * If the memory belongs to another object, that object is anchored to the
+ * view.  Functions taking an object accept views as well (see toobj_).
+ */
+
+struct view {
+	char *ptr;
+	size_t size;  /* in bytes */
+};
+
+/* Keeps the value at val_idx alive as long as the object at obj_idx */
+static
+void anchor_(lua_State *L, int obj_idx, int val_idx)
+{
+	obj_idx = lua_absindex(L, obj_idx);
+	val_idx = lua_absindex(L, val_idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, anchor_tag);
+	lua_pushvalue(L, obj_idx);
+	lua_pushvalue(L, val_idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Records that the view at view_idx shows memory of the value at src_idx.
+ * If that memory belongs to a buffer, directly or through other views, the
+ * view is added to the views of the buffer, which detaching invalidates.
+ * registry[bufviews_tag] maps each buffer to the set of its views, and
+ * each of those views to the buffer.
+ */
+static
+void addbufview_(lua_State *L, int view_idx, int src_idx)
+{
+	view_idx = lua_absindex(L, view_idx);
+	src_idx = lua_absindex(L, src_idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, bufviews_tag);
+	lua_pushvalue(L, src_idx);
+	if (lua_rawget(L, -2) != LUA_TUSERDATA) {  /* not a view of a buffer */
+		lua_pop(L, 1);
+		if (testudata_(L, src_idx, buffer_tag) == NULL) {
+			lua_pop(L, 1);
+			return;
+		}
+		lua_pushvalue(L, src_idx);
+	}
+	/* -2: bufviews, -1: the buffer */
+	lua_pushvalue(L, view_idx);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, -3) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -3);  /* weak keys, like bufviews */
+		lua_getmetatable(L, -1);
+		lua_setmetatable(L, -3);
+		lua_pop(L, 1);
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -5);
+	}
+	lua_pushvalue(L, view_idx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 3);
+}
+
+/* Returns the memory of the object or view at idx and stores its size in
+ * *len, or returns NULL if the value is neither.  (A view that is no longer
+ * valid has NULL memory of size 0.) */
+static
+void *toobj_(lua_State *L, int idx, size_t *len)
+{
+	struct view *v;
+	void *obj = testudata_(L, idx, obj_tag);
+
+	if (obj != NULL) {
+		*len = lua_rawlen(L, idx);
+		return obj;
+	}
+	if ((v = (struct view *) testudata_(L, idx, view_tag)) != NULL) {
+		*len = v->size;
+		return v->ptr;
+	}
+	return NULL;
+}
+
+static
+void *checkobj_(lua_State *L, int idx, size_t *len)
+{
+	void *obj = toobj_(L, idx, len);
+
+	if (obj == NULL) {
+		if (testudata_(L, idx, view_tag) != NULL)
+			luaL_argerror(L, idx, "view is no longer valid");
+		checkudata_(L, idx, obj_tag);  /* raises the error */
+	}
+	return obj;
+}
+
+/* Makes a view of len bytes at ptr, of the type at type_idx, at stack top */
+static
+struct view *newview_(lua_State *L, void *ptr, size_t len, int type_idx)
+{
+	struct view *v;
+
+	type_idx = lua_absindex(L, type_idx);
+	v = (struct view *) lua_newuserdata(L, sizeof *v);
+	v->ptr = (char *) ptr;
+	v->size = len;
+	setmetatable_(L, view_tag);
 	lua_pushvalue(L, type_idx);
 	lua_setuservalue(L, -2);
+	return v;
+}
+
+/** Memory accounting
+ *
+ * registry[memstats_tag] is a struct memstats, whose uservalue is a table
+ * {types, variants}:
+ * - types maps each type to a struct memcount of its objects;
+ * - variants maps a metatable to the table of its tracked variants, one
+ *   per category, which are copies with a __gc and the category stored at
+ *   key memstats_tag.
+ * When tracking is on, objects get a tracked variant of their metatable,
+ * so that collecting them updates the counts.  When it is off, objects
+ * are created as before, without finalizers.  Closures and external
+ * (non-Lua) memory are always counted, since they are released by a __gc
+ * anyway.
+ */
+
+struct memcount {
+	lua_Integer count, bytes;
+};
+
+struct memstats {
+	int track;
+	int gcpressure;  /* report external memory to the collector */
+	struct memcount cat[MEM_NCAT];
+	lua_Integer external;  /* bytes allocated outside the Lua heap */
+	lua_Integer pending;  /* external bytes not yet reported */
+};
+
+static const char *const memcat_names[MEM_NCAT] = {
+	"alloc", "return", "deref", "closure", "other",
+};
+
+static
+struct memstats *memstats_(lua_State *L)
+{
+	struct memstats *m;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, memstats_tag);
+	m = (struct memstats *) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return m;
+}
+
+/* Accounts for bytes allocated (or freed, if negative) outside Lua */
+static
+void external_(lua_State *L, lua_Integer bytes)
+{
+	struct memstats *m = memstats_(L);
+
+	m->external += bytes;
+	if (m->gcpressure && bytes > 0) {
+		m->pending += bytes;
+		if (m->pending >= 1024) {
+			lua_gc(L, LUA_GCSTEP, (int) (m->pending / 1024));
+			m->pending %= 1024;
+		}
+	}
+}
+
+/* Adds n objects of the given bytes to the per-type count of the object
+ * at idx. */
+static
+void count_type_(lua_State *L, int idx, lua_Integer n, lua_Integer bytes)
+{
+	struct memcount *c;
+
+	idx = lua_absindex(L, idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, memstats_tag);
+	lua_getuservalue(L, -1);
+	lua_rawgeti(L, -1, 1);
+	lua_getuservalue(L, idx);
+	if (lua_rawget(L, -2) != LUA_TUSERDATA) {
+		if (n < 0) {
+			lua_pop(L, 4);
+			return;
+		}
+		lua_pop(L, 1);
+		lua_getuservalue(L, idx);
+		c = (struct memcount *) lua_newuserdata(L, sizeof *c);
+		c->count = c->bytes = 0;
+		lua_rawset(L, -3);
+		lua_getuservalue(L, idx);
+		lua_rawget(L, -2);
+	}
+	c = (struct memcount *) lua_touserdata(L, -1);
+	c->count += n;
+	c->bytes += bytes;
+	lua_pop(L, 4);
+}
+
+/* obj.__gc of tracked objects */
+static
+int obj_gc(lua_State *L)
+{
+	struct memstats *m = memstats_(L);
+	lua_Integer cat, bytes = lua_rawlen(L, 1);
+
+	lua_getmetatable(L, 1);
+	lua_rawgetp(L, -1, memstats_tag);
+	cat = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	m->cat[cat].count--;
+	m->cat[cat].bytes -= bytes;
+	count_type_(L, 1, -1, -bytes);
+	return 0;
+}
+
+/* Starts tracking the object at stack top under category cat, if tracking
+ * is on.  Must be called after the object gets its final metatable. */
+static
+void track_(lua_State *L, int cat)
+{
+	struct memstats *m = memstats_(L);
+	lua_Integer bytes;
+
+	if (!m->track)
+		return;
+	bytes = lua_rawlen(L, -1);
+	m->cat[cat].count++;
+	m->cat[cat].bytes += bytes;
+	count_type_(L, -1, 1, bytes);
+	/* find or make the tracked variant of the metatable */
+	lua_rawgetp(L, LUA_REGISTRYINDEX, memstats_tag);
+	lua_getuservalue(L, -1);
+	lua_replace(L, -2);
+	lua_rawgeti(L, -1, 2);  /* variants */
+	lua_replace(L, -2);
+	lua_getmetatable(L, -2);
+	if (lua_rawget(L, -2) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, MEM_NCAT, 0);
+		lua_getmetatable(L, -3);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	if (lua_rawgeti(L, -1, cat+1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_getmetatable(L, -4);
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -5);
+		}
+		lua_pop(L, 1);
+		lua_pushcfunction(L, obj_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushinteger(L, cat);
+		lua_rawsetp(L, -2, memstats_tag);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, cat+1);
+	}
+	lua_setmetatable(L, -4);
+	lua_pop(L, 2);
+}
+
+static
+void pushmemcount_(lua_State *L, struct memcount *c)
+{
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, c->count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, c->bytes);
+	lua_setfield(L, -2, "bytes");
+}
+
+/* Reports memory held by FFI objects.
+ *
+ * Arg 1: (optional) a table of options to set first:
+ *        track: whether to track objects created from now on;
+ *        gcpressure: whether to report external memory to the collector.
+ * Returns a table with the options, the live count and bytes per category
+ * and per type (field "types", keyed by type), and "external", the bytes
+ * allocated outside the Lua heap.
+ */
+static
+int memstats(lua_State *L)
+{
+	struct memstats *m = memstats_(L);
+	int i;
+
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "track") != LUA_TNIL)
+			m->track = lua_toboolean(L, -1);
+		if (lua_getfield(L, 1, "gcpressure") != LUA_TNIL)
+			m->gcpressure = lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	lua_createtable(L, 0, MEM_NCAT + 4);
+	lua_pushboolean(L, m->track);
+	lua_setfield(L, -2, "track");
+	lua_pushboolean(L, m->gcpressure);
+	lua_setfield(L, -2, "gcpressure");
+	lua_pushinteger(L, m->external);
+	lua_setfield(L, -2, "external");
+	for (i = 0; i < MEM_NCAT; i++) {
+		pushmemcount_(L, &m->cat[i]);
+		lua_setfield(L, -2, memcat_names[i]);
+	}
+	lua_newtable(L);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, memstats_tag);
+	lua_getuservalue(L, -1);
+	lua_rawgeti(L, -1, 1);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		struct memcount *c = (struct memcount *) lua_touserdata(L, -1);
+
+		lua_pop(L, 1);
+		if (c->count == 0)
+			continue;
+		lua_pushvalue(L, -1);
+		pushmemcount_(L, c);
+		lua_rawset(L, -7);
+	}
+	lua_pop(L, 3);
+	lua_setfield(L, -2, "types");
+	return 1;
 }
 
 /* Allocate memory for objects.
@@ -257,12 +787,13 @@ void initobj_(lua_State *L, int type_idx)
 static
 int alloc(lua_State *L)
 {
-	ffi_type *type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
 	lua_Integer len = luaL_optinteger(L, 2, 1);
 
 	luaL_argcheck(L, len > 0, 2, "length must be greater than 0");
 	lua_newuserdata(L, type->size * len);
 	initobj_(L, 1);
+	track_(L, MEM_ALLOC);
 	return 1;
 }
 
@@ -274,10 +805,8 @@ int sizeof_(lua_State *L)
 	ffi_type *type;
 	size_t size;
 
-	if (luaL_testudata(L, 1, "ffi_obj") != NULL) {
-		size = lua_rawlen(L, 1);
-	} else {
-		type = (ffi_type *) luaL_checkudata(L, 1, "ffi_type");
+	if (toobj_(L, 1, &size) == NULL) {
+		type = (ffi_type *) checkudata_(L, 1, type_tag);
 		size = type->size;
 	}
 	lua_pushinteger(L, size);
@@ -288,10 +817,11 @@ int sizeof_(lua_State *L)
 static
 int typeof_(lua_State *L)
 {
-	luaL_checkudata(L, 1, "ffi_obj");
+	size_t len;
+
+	checkobj_(L, 1, &len);
 	lua_getuservalue(L, 1);
-	luaL_argcheck(L, luaL_testudata(L, -1, "ffi_type"), 1,
-		"ffi_obj is corrupted");
+	luaL_argcheck(L, testudata_(L, -1, type_tag), 1, "ffi_obj is corrupted");
 	return 1;
 }
 
@@ -304,7 +834,7 @@ static
 int ref_offset(lua_State *L)
 {
 	void *obj;
-	size_t offset;
+	size_t offset, len;
 	int ltype = lua_type(L, 1);
 
 	luaL_argcheck(L, ltype == LUA_TUSERDATA || ltype == LUA_TLIGHTUSERDATA,
@@ -312,7 +842,12 @@ int ref_offset(lua_State *L)
 	obj = lua_touserdata(L, 1);
 	offset = luaL_optinteger(L, 2, 0) * luaL_optinteger(L, 3, 1);
 	if (ltype == LUA_TUSERDATA) {
-		luaL_argcheck(L, 0 <= offset && offset < lua_rawlen(L, 1), 2,
+		obj = toobj_(L, 1, &len);
+		if (obj == NULL && testudata_(L, 1, view_tag) == NULL) {
+			obj = lua_touserdata(L, 1);
+			len = lua_rawlen(L, 1);
+		}
+		luaL_argcheck(L, 0 <= offset && offset < len, 2,
 			"offset out of bound");
 	}
 	lua_pushlightuserdata(L, (char *) obj + offset);
@@ -320,30 +855,28 @@ int ref_offset(lua_State *L)
 	return 1;
 }
 
-/* For object o and key k, get the type and offset of
+/* For object o and key k, push and return the type, and get the offset of
  * - the k-th element in an array, if k is an integer (1-based index);
  * - the field named k in a struct, if k is a string.
  */
 static
-void push_type_offset_(lua_State *L, int o, int k)
+ffi_type *push_type_offset_(lua_State *L, int o, int k, size_t *offset)
 {
 	ffi_type *type;
 
 	lua_getuservalue(L, o);
-	type = (ffi_type *) luaL_checkudata(L, -1, "ffi_type");
+	type = totype_(L, -1);
 
 	if (lua_isinteger(L, k)) {
 		lua_Integer idx;
 
 		idx = lua_tointeger(L, k);
-		lua_pushinteger(L, (idx-1) * type->size);
-	} else {
-		lua_pushcfunction(L, getfield);
-		lua_insert(L, -2);
-		lua_pushvalue(L, k);
-		/* getfield type key */
-		lua_call(L, 2, 2);
+		luaL_argcheck(L, idx >= 1, k, "index out of bound");
+		*offset = (idx-1) * type->size;
+		return type;
 	}
+	*offset = field_(L, k);
+	return totype_(L, -1);
 }
 
 static void cast2c(lua_State *L, int idx, void *addr, ffi_type *type);
@@ -355,13 +888,11 @@ int objindex(lua_State *L)
 {
 	ffi_type *type;
 	void *obj;
-	size_t offset;
+	size_t offset, len;
 
-	obj = luaL_checkudata(L, 1, "ffi_obj");
-	push_type_offset_(L, 1, 2);
-	type = (ffi_type *) luaL_checkudata(L, -2, "ffi_type");
-	offset = luaL_checkinteger(L, -1);
-	luaL_argcheck(L, offset + type->size <= lua_rawlen(L, 1),
+	obj = checkobj_(L, 1, &len);
+	type = push_type_offset_(L, 1, 2, &offset);
+	luaL_argcheck(L, offset + type->size <= len,
 		2, "access out of bound");
 	cast2lua(L, (char *) obj + offset, type);
 	return 1;
@@ -373,13 +904,11 @@ int obj_newindex(lua_State *L)
 {
 	ffi_type *type;
 	void *obj;
-	size_t offset;
+	size_t offset, len;
 
-	obj = luaL_checkudata(L, 1, "ffi_obj");
-	push_type_offset_(L, 1, 2);
-	type = (ffi_type *) luaL_checkudata(L, -2, "ffi_type");
-	offset = luaL_checkinteger(L, -1);
-	luaL_argcheck(L, offset + type->size <= lua_rawlen(L, 1),
+	obj = checkobj_(L, 1, &len);
+	type = push_type_offset_(L, 1, 2, &offset);
+	luaL_argcheck(L, offset + type->size <= len,
 		2, "access out of bound");
 	cast2c(L, 3, (char *) obj + offset, type);
 	return 1;
@@ -390,11 +919,12 @@ static
 int obj_len(lua_State *L)
 {
 	ffi_type *type;
+	size_t len;
 
-	luaL_checkudata(L, 1, "ffi_obj");
+	checkobj_(L, 1, &len);
 	lua_getuservalue(L, 1);
-	type = (ffi_type *) luaL_checkudata(L, -1, "ffi_type");
-	lua_pushinteger(L, lua_rawlen(L, 1) / type->size);
+	type = totype_(L, -1);
+	lua_pushinteger(L, len / type->size);
 	return 1;
 }
 
@@ -407,14 +937,14 @@ int obj_tostr(lua_State *L)
 	size_t len;
 	luaL_Buffer B;
 
-	obj = luaL_checkudata(L, 1, "ffi_obj");
-	len = lua_rawlen(L, 1);
+	obj = checkobj_(L, 1, &len);
 
 	luaL_buffinit(L, &B);
-	lua_pushfstring(L, "ffi_obj: %p <", obj);
+	lua_pushfstring(L, "%s: %p <",
+		testudata_(L, 1, view_tag) ? "ffi_view" : "ffi_obj", obj);
 	luaL_addvalue(&B);
 	lua_getuservalue(L, 1);
-	type = (ffi_type *) luaL_checkudata(L, -1, "ffi_type");
+	type = totype_(L, -1);
 	add_type(&B, type);
 	len /= type->size;
 	if (len > 1) {
@@ -432,8 +962,9 @@ int obj_tostr(lua_State *L)
 static
 int deref(lua_State *L)
 {
-	void *obj = luaL_testudata(L, 1, "ffi_obj");
-	ffi_type *type = (ffi_type *) luaL_checkudata(L, 2, "ffi_type");
+	size_t len;
+	void *obj = toobj_(L, 1, &len);
+	ffi_type *type = (ffi_type *) checkudata_(L, 2, type_tag);
 	size_t offset = luaL_optinteger(L, 3, 0);
 	void *p;
 
@@ -442,7 +973,7 @@ int deref(lua_State *L)
 			"expecting ffi_obj or light userdata");
 		obj = lua_touserdata(L, 1);
 	} else {
-		luaL_argcheck(L, offset + type->size <= lua_rawlen(L, 1), 2,
+		luaL_argcheck(L, offset + type->size <= len, 2,
 			"offset out of bound");
 	}
 	switch (type->type) {
@@ -450,6 +981,7 @@ int deref(lua_State *L)
 	case FFI_TYPE_COMPLEX:
 		p = lua_newuserdata(L, type->size);
 		initobj_(L, 2);
+		track_(L, MEM_DEREF);
 		memcpy(p, (char *) obj + offset, type->size);
 		return 1;
 	}
@@ -458,526 +990,4672 @@ int deref(lua_State *L)
 }
 
 
-/** FFI Call InterFace
+/** Typed arrays
  *
- * For a cif with N arguments, the memory allocated is:
- * 	ffi_cif cif;
- *	ffi_type *atypes[N];
- * and cif.arg_types points to atypes.  The userdata is a table whose array
- * part is a sequence of argument types and field "ret" is the return type.
+ * ffi.array(T, n) allocates an ffi_obj like alloc, with a metatable of its
+ * own for each scalar type T.  Its __index and __newindex handle integer
+ * keys with the element type fixed at compile time, and leave other keys,
+ * and values needing conversion, to objindex and obj_newindex.
+ * ffi.unchecked(arr) makes a view of the same memory whose element access
+ * checks neither the key, the bound nor the value, only that the view is
+ * still valid.
  */
 
-/* {ret = rtype; atypes...} -> cif
- */
 static
-int makecif(lua_State *L)
+void pushptr_(lua_State *L, void *p)
 {
-	int abi;
-	ffi_cif *cif;
-	ffi_type *rtype = &ffi_type_void, **atypes;
-	unsigned int len, i;
+	(p == NULL) ? lua_pushnil(L) : lua_pushlightuserdata(L, p);
+}
 
-	luaL_checktype(L, 1, LUA_TTABLE);
-	len = lua_rawlen(L, 1);
-	cif = (ffi_cif *) lua_newuserdata(L,
-		sizeof *cif + len * sizeof (ffi_type *));
-	luaL_setmetatable(L, "ffi_cif");
-	lua_pushvalue(L, 1);
-	lua_setuservalue(L, -2);
-	atypes = (ffi_type **) (cif + 1);
-	if (lua_getfield(L, 1, "ret") != LUA_TNIL) {
-		rtype = (ffi_type *) luaL_checkudata(L, -1, "ffi_type");
-	}
-	lua_getfield(L, 1, "ABI");
-	abi = luaL_optinteger(L, -1, FFI_DEFAULT_ABI);
-	lua_pop(L, 2);  /* rtype and ABI */
-	for (i = 0; i < len; i++) {
-		lua_rawgeti(L, 1, i+1);
-		atypes[i] = (ffi_type *) luaL_checkudata(L, -1, "ffi_type");
-		lua_pop(L, 1);
-	}
-	ffi_prep_cif(cif, abi, len, rtype, atypes);
-	return 1;
+#define isnumber_(L, idx) (lua_type(L, (idx)) == LUA_TNUMBER)
+
+#define ARRAY_FNS(c_type, name, push, test, to) \
+static int arrget_##name(lua_State *L) \
+{ \
+	lua_Integer i; \
+	if (lua_isinteger(L, 2)) { \
+		i = lua_tointeger(L, 2) - 1; \
+		if ((lua_Unsigned) i < lua_rawlen(L, 1) / sizeof (c_type)) { \
+			push(L, ((c_type *) lua_touserdata(L, 1))[i]); \
+			return 1; \
+		} \
+	} \
+	return objindex(L); \
+} \
+static int arrset_##name(lua_State *L) \
+{ \
+	lua_Integer i; \
+	if (lua_isinteger(L, 2) && test(L, 3)) { \
+		i = lua_tointeger(L, 2) - 1; \
+		if ((lua_Unsigned) i < lua_rawlen(L, 1) / sizeof (c_type)) { \
+			((c_type *) lua_touserdata(L, 1))[i] = (c_type) to(L, 3); \
+			return 0; \
+		} \
+	} \
+	return obj_newindex(L); \
+} \
+static int uarrget_##name(lua_State *L) \
+{ \
+	c_type *p = (c_type *) ((struct view *) lua_touserdata(L, 1))->ptr; \
+	if (p == NULL) \
+		return luaL_error(L, "view is no longer valid"); \
+	push(L, p[lua_tointeger(L, 2) - 1]); \
+	return 1; \
+} \
+static int uarrset_##name(lua_State *L) \
+{ \
+	c_type *p = (c_type *) ((struct view *) lua_touserdata(L, 1))->ptr; \
+	if (p == NULL) \
+		return luaL_error(L, "view is no longer valid"); \
+	p[lua_tointeger(L, 2) - 1] = (c_type) to(L, 3); \
+	return 0; \
 }
 
+#define INT_ARRAY_FNS(ffi_type, c_type, name) \
+	ARRAY_FNS(c_type, name, lua_pushinteger, lua_isinteger, lua_tointeger)
+#define FLOAT_ARRAY_FNS(ffi_type, c_type, name) \
+	ARRAY_FNS(c_type, name, lua_pushnumber, isnumber_, lua_tonumber)
+INT_TYPE_LIST_(INT_ARRAY_FNS)
+FLOAT_TYPE_LIST_(FLOAT_ARRAY_FNS)
+ARRAY_FNS(void *, pointer, pushptr_, lua_islightuserdata, lua_touserdata)
+#undef FLOAT_ARRAY_FNS
+#undef INT_ARRAY_FNS
+#undef ARRAY_FNS
+
+static const struct {
+	unsigned short type;
+	lua_CFunction get, set, uget, uset;
+} array_fns[] = {
+#define ENTRY(ffi_type, c_type, name) \
+	{ffi_type, arrget_##name, arrset_##name, uarrget_##name, uarrset_##name},
+	INT_TYPE_LIST_(ENTRY)
+	FLOAT_TYPE_LIST_(ENTRY)
+	ENTRY(FFI_TYPE_POINTER, void *, pointer)
+#undef ENTRY
+};
+
+/* Pushes the array metatable for the type at type_idx (the unchecked one
+ * if unchecked is set).  Returns 0 and pushes nothing if the type is not
+ * a scalar.
+ */
 static
-void add_cif(luaL_Buffer *B, ffi_cif *cif)
+int push_arraymt_(lua_State *L, int type_idx, int unchecked)
 {
-	unsigned i;
-
-	add_type(B, cif->rtype);
-	if (cif->nargs == 0) {
-		luaL_addstring(B, "()");
-	} else {
-		luaL_addchar(B, '(');
-		i = 0;
-		for (;;) {
-			add_type(B, cif->arg_types[i]);
-			if (++i == cif->nargs) {
-				break;
-			}
-			luaL_addstring(B, ", ");
-		}
-		luaL_addchar(B, ')');
+	static const luaL_Reg array_reg[] = {
+		{"__len", obj_len},
+		{"__tostring", obj_tostr},
+		{NULL, NULL},
+	};
+	const char *cache = unchecked ? uarray_tag : array_tag;
+	ffi_type *type = totype_(L, type_idx);
+	size_t i;
+
+	type_idx = lua_absindex(L, type_idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, cache);
+	lua_pushvalue(L, type_idx);
+	if (lua_rawget(L, -2) == LUA_TTABLE) {
+		lua_replace(L, -2);
+		return 1;
+	}
+	lua_pop(L, 1);
+	for (i = 0; i < sizeof array_fns / sizeof array_fns[0]; i++) {
+		if (array_fns[i].type == type->type)
+			break;
+	}
+	if (i == sizeof array_fns / sizeof array_fns[0]) {
+		lua_pop(L, 1);
+		return 0;
 	}
+	lua_createtable(L, 0, 6);
+	luaL_setfuncs(L, array_reg, 0);
+	lua_pushcfunction(L, unchecked ? array_fns[i].uget : array_fns[i].get);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, unchecked ? array_fns[i].uset : array_fns[i].set);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, -2, unchecked ? view_tag : obj_tag);
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, -2, cache);
+	lua_pushvalue(L, type_idx);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_replace(L, -2);
+	return 1;
 }
 
-/* cif.__tostring */
+/* Allocates a typed array.
+ *
+ * Arg 1: Type.
+ * Arg 2: N (default: 1).
+ * Returns an ffi_obj holding N values of the type, with fast element access
+ * if the type is a scalar.
+ */
 static
-int cif_tostr(lua_State *L)
+int array(lua_State *L)
 {
-	ffi_cif *cif = (ffi_cif *) luaL_checkudata(L, 1, "ffi_cif");
-	luaL_Buffer B;
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
+	lua_Integer len = luaL_optinteger(L, 2, 1);
 
-	luaL_buffinit(L, &B);
-	lua_pushfstring(L, "ffi_cif: %p <", cif);
-	luaL_addstring(&B, lua_tostring(L, -1));
-	add_cif(&B, cif);
-	luaL_addchar(&B, '>');
-	luaL_pushresult(&B);
+	luaL_argcheck(L, len > 0, 2, "length must be greater than 0");
+	lua_newuserdata(L, type->size * len);
+	initobj_(L, 1);
+	if (push_arraymt_(L, 1, 0))
+		lua_setmetatable(L, -2);
+	track_(L, MEM_ALLOC);
 	return 1;
 }
 
-
-/* Calling FFI functions
+/* Makes an unchecked view of an array of scalars.
  *
- * It involves these steps:
- * - Convert arguments into C values;
- * - Invoke ffi_call();
- * - Convert return value into Lua value.
+ * Indexing the view reads or writes element k without checking that k is
+ * an integer in range; values stored must be numbers (integers for integer
+ * types) or light userdata.  The view keeps the array alive.
  */
-static int funccall(lua_State *L);
+static
+int unchecked(lua_State *L)
+{
+	size_t len;
+	void *obj = checkobj_(L, 1, &len);
 
-/* Casts a Lua value to a C pointer */
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1);
+	newview_(L, obj, len, 2);
+	luaL_argcheck(L, push_arraymt_(L, 2, 1), 1,
+		"element type is not a scalar");
+	lua_setmetatable(L, -2);
+	anchor_(L, -1, 1);
+	addbufview_(L, -1, 1);
+	return 1;
+}
+
+/* Makes an array of pointers to strings, such as a char ** argument.
+ *
+ * Arg 1: a sequence of strings.
+ * Arg 2: (optional) whether to end the array with a NULL pointer.
+ * Returns a typed array of pointers, which keeps the strings alive.
+ * Upvalue: the stock pointer type.
+ */
 static
-int cast2ptr(lua_State *L, int idx, void **ptr)
+int strarray(lua_State *L)
 {
-	int ltype = lua_type(L, idx);
-	lua_CFunction fn;
-	void *p;
+	int nul = lua_toboolean(L, 2);
+	lua_Integer n, i;
+	const char **p;
 
-	switch (ltype) {
-		case LUA_TNIL:
-			*ptr = NULL;
-			break;
-		case LUA_TSTRING:
-			/* FFI discards the `const' qualifier;
-			 * the C function must not change the string. */
-			*ptr = (void *) lua_tostring(L, idx);
-			break;
-		case LUA_TFUNCTION:
-			fn = lua_tocfunction(L, idx);
-			if (fn == funccall) {  /* FFI func */
-				lua_getupvalue(L, idx, 2);
-				fn = lua_tocfunction(L, -1);
-				lua_pop(L, 1);
-			} else if (lua_getupvalue(L, idx, 1)) {
-				/* C closure is not supported */
-				return 0;
-			}
-			/* Lua function is not supported; user should create
-			 * closure explicitly.
-			 */
-			if (fn == NULL)
-				return 0;
-			*ptr = (void *) fn;
-			break;
-		case LUA_TLIGHTUSERDATA:
-			*ptr = lua_touserdata(L, idx);
-			break;
-		case LUA_TUSERDATA:
-			p = lua_touserdata(L, idx);
-			if (luaL_testudata(L, idx, "ffi_closure")) {
-				*ptr = ((struct closure *) p)->exec_addr;
-			} else {
-				*ptr = p;
-			}
-			break;
-		default:
-			return 0;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_rawlen(L, 1);
+	luaL_argcheck(L, n + nul > 0, 1, "no strings");
+	lua_settop(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));  /* 2: the pointer type */
+	p = (const char **) lua_newuserdata(L, sizeof *p * (n + nul));
+	initobj_(L, 2);
+	if (push_arraymt_(L, 2, 0))
+		lua_setmetatable(L, -2);
+	track_(L, MEM_ALLOC);
+	lua_createtable(L, n, 0);  /* 4: the strings */
+	for (i = 0; i < n; i++) {
+		if (lua_rawgeti(L, 1, i+1) != LUA_TSTRING) {
+			lua_pushfstring(L, "element %I is not a string", i+1);
+			return luaL_argerror(L, 1, lua_tostring(L, -1));
+		}
+		p[i] = lua_tostring(L, -1);
+		lua_rawseti(L, 4, i+1);
 	}
+	if (nul)
+		p[n] = NULL;
+	anchor_(L, 3, 4);
+	lua_settop(L, 3);
 	return 1;
 }
 
-/* Casts of numeric values to C */
-#define CAST_CASE(ffi_type, c_type, ...) \
-	case ffi_type: *(c_type *) addr = n; return 1;
-#define COMPLEX_CASE(ffi_type, c_type, ...) \
-	case sizeof (c_type _Complex): *(c_type _Complex *) addr = n; return 1;
-#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
-# define COMPLEX_CASES \
-	case FFI_TYPE_COMPLEX: \
-		switch (type->size) { FLOAT_TYPE_LIST_(COMPLEX_CASE) }
-#else
-# define COMPLEX_CASES
-#endif
 
-#define CAST_TMPL(NAME, TYPE) \
-static int NAME(TYPE n, void *addr, ffi_type *type) \
-{ \
-	switch (type->type) { \
-		INT_TYPE_LIST_(CAST_CASE) \
-		FLOAT_TYPE_LIST_(CAST_CASE) \
-		COMPLEX_CASES \
-	} \
-	return 0; \
+/** Cursors
+ *
+ * A cursor is a view of one element of an array, which is moved in place
+ * by cur:seek(i) and cur:next(), so iterating allocates nothing.  Indexing
+ * the cursor reads or writes the fields of the current element, which is
+ * an error before the first move; the method names shadow fields of the
+ * same name.  The cursor keeps the array
+ * alive.  A cursor over a view takes the view's memory again on each move,
+ * and raises an error once the view is no longer valid.
+ */
+
+struct cursor {
+	struct view v;  /* the current element; must be first */
+	struct view *src;  /* the view moved over, or NULL for an object */
+	char *base;
+	size_t n;  /* number of elements */
+	size_t elemsize;
+	lua_Integer pos;  /* 1-based; 0 before the first element */
+};
+
+static
+struct cursor *checkcursor_(lua_State *L, int idx)
+{
+	return (struct cursor *) checkudata_(L, idx, cursor_tag);
 }
 
-CAST_TMPL(castint2c, lua_Integer)
-CAST_TMPL(castnum2c, lua_Number)
+/* Takes the memory of the view under the cursor again */
+static
+void cursor_sync_(lua_State *L, struct cursor *cur)
+{
+	if (cur->src == NULL)
+		return;
+	if (cur->src->ptr == NULL)
+		luaL_error(L, "view under the cursor is no longer valid");
+	cur->base = cur->src->ptr;
+	cur->n = cur->src->size / cur->elemsize;
+}
 
-#undef CAST_TMPL
-#undef COMPLEX_CASES
-#undef COMPLEX_CASE
-#undef CAST_CASE
+static
+void cursor_moveto_(struct cursor *cur, lua_Integer i)
+{
+	cur->pos = i;
+	if (i == 0) {  /* no current element */
+		cur->v.ptr = NULL;
+		cur->v.size = 0;
+	} else {
+		cur->v.ptr = cur->base + (i - 1) * cur->elemsize;
+		cur->v.size = cur->elemsize;
+	}
+}
 
-/* Copies C value into a userdata at idx */
+/* cur:seek(i) -> cur; moves to element i */
 static
-int cast2obj(lua_State *L, int idx, void *addr, ffi_type *type)
+int cursor_seek(lua_State *L)
 {
-	void *obj = luaL_testudata(L, idx, "ffi_obj");
+	struct cursor *cur = checkcursor_(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
 
-	if (obj == NULL)
+	cursor_sync_(L, cur);
+	luaL_argcheck(L, 1 <= i && (lua_Unsigned) i <= cur->n, 2,
+		"index out of bound");
+	cursor_moveto_(cur, i);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* cur:next() -> cur; moves to the next element, or returns nil at the end
+ */
+static
+int cursor_next(lua_State *L)
+{
+	struct cursor *cur = checkcursor_(L, 1);
+
+	cursor_sync_(L, cur);
+	if ((lua_Unsigned) cur->pos >= cur->n)
 		return 0;
-	lua_getuservalue(L, idx);
-	if (luaL_testudata(L, -1, "ffi_type") == type) {
-		memcpy(addr, obj, type->size);
-		return 1;
-	}
-	return 0;
+	cursor_moveto_(cur, cur->pos + 1);
+	lua_settop(L, 1);
+	return 1;
 }
 
-/* Casts a Lua value into C */
 static
-void cast2c(lua_State *L, int idx, void *addr, ffi_type *type)
+int cursor_index(lua_State *L)
 {
-	int ltype = lua_type(L, idx);
-	int rc = 0;
+	const char *k;
 
-	if (ltype == LUA_TBOOLEAN) {
-		rc = castint2c(lua_toboolean(L, idx), addr, type);
-	} else if (ltype == LUA_TNUMBER) {
-		rc = (lua_isinteger(L, idx)) ?
-			castint2c(lua_tointeger(L, idx), addr, type) :
-			castnum2c(lua_tonumber(L, idx), addr, type);
-	} else if (type->type == FFI_TYPE_POINTER) {
-		rc = cast2ptr(L, idx, (void **) addr);
-	} else if (type->type == FFI_TYPE_STRUCT ||
-			type->type == FFI_TYPE_COMPLEX) {
-		rc = cast2obj(L, idx, addr, type);
+	/* tested first, as lua_tostring would convert a number in place */
+	if (lua_type(L, 2) == LUA_TSTRING && (k = lua_tostring(L, 2)) != NULL) {
+		if (strcmp(k, "next") == 0) {
+			lua_pushcfunction(L, cursor_next);
+			return 1;
+		} else if (strcmp(k, "seek") == 0) {
+			lua_pushcfunction(L, cursor_seek);
+			return 1;
+		}
 	}
-	if (rc == 0) {
-		luaL_Buffer B;
+	if (checkcursor_(L, 1)->pos == 0)
+		luaL_argerror(L, 1, "cursor not positioned");
+	return objindex(L);
+}
 
-		luaL_buffinit(L, &B);
-		luaL_addstring(&B, "expect ");
-		add_type(&B, type);
-		luaL_addstring(&B, ", got ");
-		luaL_addstring(&B, lua_typename(L, ltype));
-		luaL_pushresult(&B);
-		luaL_argerror(L, idx, lua_tostring(L, -1));
-	}
+static
+int cursor_newindex(lua_State *L)
+{
+	if (checkcursor_(L, 1)->pos == 0)
+		luaL_argerror(L, 1, "cursor not positioned");
+	return obj_newindex(L);
 }
 
-/* Casts numeric values from C */
-#define CASE(ffi_type, c_type, ...) \
-	case ffi_type: *n = *(c_type *) addr; return 1;
-#define CAST_TMPL(TYPE, NAME, TYPE_LIST) \
-static int NAME(TYPE *n, void *addr, ffi_type *type) \
-{ \
-	switch (type->type) { TYPE_LIST(CASE) } \
-	return 0; \
+/* cursor.__tostring */
+static
+int cursor_tostr(lua_State *L)
+{
+	struct cursor *cur = checkcursor_(L, 1);
+
+	lua_pushfstring(L, "ffi_cursor: %p [%I/%I]", cur->base,
+		cur->pos, (lua_Integer) cur->n);
+	return 1;
 }
 
-CAST_TMPL(lua_Integer, cast2lua_int, INT_TYPE_LIST_)
-CAST_TMPL(lua_Number, cast2lua_num, FLOAT_TYPE_LIST_)
+/* Makes a cursor over the array at idx, before its first element */
+static
+struct cursor *newcursor_(lua_State *L, int idx)
+{
+	struct cursor *cur;
+	ffi_type *type;
+	size_t len;
+	void *obj;
 
-#undef CAST_TMPL
-#undef CASE
+	idx = lua_absindex(L, idx);
+	obj = checkobj_(L, idx, &len);
+	luaL_argcheck(L, obj != NULL, idx, "view is not valid");
+	lua_getuservalue(L, idx);
+	type = totype_(L, -1);
+	luaL_argcheck(L, type->size > 0, idx, "element has no size");
+	cur = (struct cursor *) lua_newuserdata(L, sizeof *cur);
+	setmetatable_(L, cursor_tag);
+	lua_pushvalue(L, -2);
+	lua_setuservalue(L, -2);
+	lua_remove(L, -2);
+	cur->src = (struct view *) testudata_(L, idx, view_tag);
+	cur->base = (char *) obj;
+	cur->n = len / type->size;
+	cur->elemsize = type->size;
+	cursor_moveto_(cur, 0);
+	anchor_(L, -1, idx);
+	addbufview_(L, -1, idx);
+	return cur;
+}
 
-/* Casts a C value into Lua */
+/* Makes a cursor.
+ *
+ * Arg 1: an array object or view.
+ * Arg 2: (optional) the index of the element to start at.
+ * Returns the cursor, before the first element if no index is given.
+ */
 static
-void cast2lua(lua_State *L, void *addr, ffi_type *type)
+int makecursor(lua_State *L)
 {
-	lua_Integer i;
-	lua_Number n;
-	void *p;
+	lua_Integer i = luaL_optinteger(L, 2, 0);
+	struct cursor *cur = newcursor_(L, 1);
+
+	luaL_argcheck(L, 0 <= i && (lua_Unsigned) i <= cur->n, 2,
+		"index out of bound");
+	cursor_moveto_(cur, i);
+	return 1;
+}
+
+static
+int each_next(lua_State *L)
+{
+	struct cursor *cur = checkcursor_(L, 1);
+
+	cursor_sync_(L, cur);
+	if ((lua_Unsigned) cur->pos >= cur->n)
+		return 0;
+	cursor_moveto_(cur, cur->pos + 1);
+	lua_pushinteger(L, cur->pos);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
+/* for i, cur in each(arr) do ... end
+ *
+ * Iterates over an array with a single cursor.
+ */
+static
+int each(lua_State *L)
+{
+	lua_pushcfunction(L, each_next);
+	newcursor_(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+
+/** Sorting and searching
+ *
+ * Sort keys are fields of the elements, resolved once to an offset and a
+ * scalar type.  A single integer, float or pointer key is sorted by LSD
+ * radix sort on a 64-bit image of the key that preserves the order; other
+ * cases by merge sort with a comparison per key type.  Both are stable.
+ * Elements are then moved into place with one copy each way.
+ */
+
+struct sortkey {
+	size_t offset;
+	unsigned short type;
+};
+
+struct radixitem {
+	uint64_t key;
+	size_t idx;
+};
+
+/* Resolves the field at key_idx (nil for the element itself) of the
+ * element type at type_idx into k.  Returns the type of the key, which the
+ * element type keeps alive. */
+static
+ffi_type *sortkey_(lua_State *L, int type_idx, int key_idx, struct sortkey *k)
+{
+	ffi_type *type;
 
+	key_idx = lua_absindex(L, key_idx);
+	lua_pushvalue(L, type_idx);
+	k->offset = lua_isnil(L, key_idx) ? 0 : field_(L, key_idx);
+	type = totype_(L, -1);
+	lua_pop(L, 1);
 	switch (type->type) {
-#define CASE(ffi_type, c_type, ...) case ffi_type:
+#define CASE(ffi_type, ...) case ffi_type:
 	INT_TYPE_LIST_(CASE)
-		if (cast2lua_int(&i, addr, type)) {
-			lua_pushinteger(L, i);
-			return;
-		}
-		break;
 	FLOAT_TYPE_LIST_(CASE)
-		if (cast2lua_num(&n, addr, type)) {
-			lua_pushnumber(L, n);
+#undef CASE
+	case FFI_TYPE_POINTER:
+		k->type = type->type;
+		return type;
+	}
+	luaL_argerror(L, key_idx, "key is not a scalar");
+	return NULL;
+}
+
+static
+int cmpkey_(unsigned short type, const char *a, const char *b)
+{
+	switch (type) {
+#define CASE(ffi_type, c_type, ...) \
+	case ffi_type: \
+		return (*(c_type *) a > *(c_type *) b) - \
+			(*(c_type *) a < *(c_type *) b);
+	INT_TYPE_LIST_(CASE)
+	FLOAT_TYPE_LIST_(CASE)
+	CASE(FFI_TYPE_POINTER, uintptr_t)
+#undef CASE
+	}
+	return 0;
+}
+
+/* Maps a key to an unsigned integer of the same order */
+static
+uint64_t radixkey_(unsigned short type, const char *p)
+{
+	union { double d; uint64_t u; } f;
+
+	switch (type) {
+#define CASE(ffi_type, c_type, ...) \
+	case ffi_type: return *(c_type *) p;
+#define SCASE(ffi_type, c_type, ...) \
+	case ffi_type: return (uint64_t) (int64_t) *(c_type *) p ^ \
+		(UINT64_C(1) << 63);
+	CASE(FFI_TYPE_UINT8, uint8_t)
+	CASE(FFI_TYPE_UINT16, uint16_t)
+	CASE(FFI_TYPE_UINT32, uint32_t)
+	CASE(FFI_TYPE_UINT64, uint64_t)
+	CASE(FFI_TYPE_POINTER, uintptr_t)
+	SCASE(FFI_TYPE_SINT8, int8_t)
+	SCASE(FFI_TYPE_SINT16, int16_t)
+	SCASE(FFI_TYPE_SINT32, int32_t)
+	SCASE(FFI_TYPE_SINT64, int64_t)
+#undef SCASE
+#undef CASE
+	case FFI_TYPE_FLOAT:
+		f.d = *(float *) p;
+		break;
+	default:
+		f.d = *(double *) p;
+	}
+	return (f.u >> 63) ? ~f.u : f.u | (UINT64_C(1) << 63);
+}
+
+/* Sorts items[0..n) by key, using tmp of the same size.  Returns the
+ * sorted array, which is either items or tmp. */
+static
+struct radixitem *radixsort_(struct radixitem *items, struct radixitem *tmp,
+	size_t n)
+{
+	size_t count[256];
+	unsigned shift;
+	size_t i;
+
+	for (shift = 0; shift < 64; shift += 8) {
+		struct radixitem *t;
+		size_t sum = 0;
+
+		memset(count, 0, sizeof count);
+		for (i = 0; i < n; i++)
+			count[(items[i].key >> shift) & 0xff]++;
+		if (count[(items[0].key >> shift) & 0xff] == n)
+			continue;  /* all in one bucket */
+		for (i = 0; i < 256; i++) {
+			size_t c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(items[i].key >> shift) & 0xff]++] = items[i];
+		t = items; items = tmp; tmp = t;
+	}
+	return items;
+}
+
+/* Sorts the indexes idx[0..n) of elements of base by keys, using tmp of
+ * the same size.  Returns the sorted array, which is either idx or tmp. */
+static
+size_t *mergesort_(size_t *idx, size_t *tmp, size_t n, const char *base,
+	size_t size, const struct sortkey *keys, unsigned nkeys, int desc)
+{
+	size_t width, i;
+
+	for (width = 1; width < n; width *= 2) {
+		size_t *t;
+
+		for (i = 0; i < n; i += 2 * width) {
+			size_t a = i, m = (i + width < n) ? i + width : n;
+			size_t b = m, e = (i + 2 * width < n) ? i + 2 * width : n;
+			size_t o = i;
+
+			while (a < m && b < e) {
+				int c = 0;
+				unsigned k;
+
+				for (k = 0; k < nkeys && c == 0; k++) {
+					c = cmpkey_(keys[k].type,
+						base + idx[b] * size + keys[k].offset,
+						base + idx[a] * size + keys[k].offset);
+				}
+				/* take from b only if strictly before a */
+				tmp[o++] = ((desc ? -c : c) < 0) ? idx[b++] : idx[a++];
+			}
+			while (a < m)
+				tmp[o++] = idx[a++];
+			while (b < e)
+				tmp[o++] = idx[b++];
+		}
+		t = idx; idx = tmp; tmp = t;
+	}
+	return idx;
+}
+
+/* Sorts an array in place.
+ *
+ * Arg 1: an array (ffi_obj or view).
+ * Arg 2: a field name or index, or a sequence of them (most significant
+ *        first); nil to compare the elements themselves.
+ * Arg 3: (optional) true to sort in descending order.
+ */
+static
+int sort(lua_State *L)
+{
+	size_t len, size, n, i;
+	char *base = (char *) checkobj_(L, 1, &len), *out;
+	struct sortkey *keys;
+	unsigned nkeys = 1, k;
+	int desc;
+	size_t *order = NULL;
+
+	lua_settop(L, 3);
+	desc = lua_toboolean(L, 3);
+	lua_getuservalue(L, 1);  /* 4: element type */
+	size = totype_(L, 4)->size;
+	n = (size == 0) ? 0 : len / size;
+	if (lua_istable(L, 2))
+		nkeys = lua_rawlen(L, 2);
+	luaL_argcheck(L, nkeys > 0, 2, "no key");
+	keys = (struct sortkey *) lua_newuserdata(L, sizeof *keys * nkeys);
+	for (k = 0; k < nkeys; k++) {
+		if (lua_istable(L, 2)) {
+			lua_rawgeti(L, 2, k+1);
+			sortkey_(L, 4, -1, &keys[k]);
+			lua_pop(L, 1);
+		} else {
+			sortkey_(L, 4, 2, &keys[k]);
+		}
+	}
+	if (n < 2)
+		return 0;
+	out = (char *) malloc(n * size);
+	if (out == NULL)
+		return luaL_error(L, "not enough memory");
+	if (nkeys == 1 && keys[0].type != FFI_TYPE_LONGDOUBLE) {
+		struct radixitem *items, *sorted;
+
+		items = (struct radixitem *) malloc(sizeof *items * n * 2);
+		if (items == NULL) {
+			free(out);
+			return luaL_error(L, "not enough memory");
+		}
+		for (i = 0; i < n; i++) {
+			uint64_t key = radixkey_(keys[0].type,
+				base + i * size + keys[0].offset);
+			items[i].key = desc ? ~key : key;
+			items[i].idx = i;
+		}
+		sorted = radixsort_(items, items + n, n);
+		for (i = 0; i < n; i++)
+			memcpy(out + i * size, base + sorted[i].idx * size, size);
+		free(items);
+	} else {
+		size_t *idx;
+
+		order = (size_t *) malloc(sizeof *order * n * 2);
+		if (order == NULL) {
+			free(out);
+			return luaL_error(L, "not enough memory");
+		}
+		for (i = 0; i < n; i++)
+			order[i] = i;
+		idx = mergesort_(order, order + n, n, base, size,
+			keys, nkeys, desc);
+		for (i = 0; i < n; i++)
+			memcpy(out + i * size, base + idx[i] * size, size);
+		free(order);
+	}
+	memcpy(base, out, n * size);
+	free(out);
+	return 0;
+}
+
+/* Searches a sorted array.
+ *
+ * Arg 1: an array sorted in ascending order of the key.
+ * Arg 2: a field name or index; nil for the elements themselves.
+ * Arg 3: the value to search for.
+ * Returns the index of the first element whose key equals the value, or
+ * nil; followed by the index where the value would be inserted.
+ */
+static
+int search(lua_State *L)
+{
+	size_t len, size, lo, hi;
+	char *base = (char *) checkobj_(L, 1, &len);
+	struct sortkey key;
+	union { long double ld; uint64_t u; void *p; } value;
+	ffi_type *ktype;
+
+	lua_settop(L, 3);
+	lua_getuservalue(L, 1);  /* 4: element type */
+	size = totype_(L, 4)->size;
+	ktype = sortkey_(L, 4, 2, &key);
+	switch (key.type) {
+#define CASE(ffi_type, ...) case ffi_type:
+	INT_TYPE_LIST_(CASE)
+#undef CASE
+		/* rather than truncating a float */
+		luaL_checkinteger(L, 3);
+	}
+	cast2c(L, 3, &value, ktype);
+	lo = 0;
+	hi = (size == 0) ? 0 : len / size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cmpkey_(key.type, base + mid * size + key.offset,
+				(char *) &value) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo * size < len && cmpkey_(key.type,
+			base + lo * size + key.offset, (char *) &value) == 0) {
+		lua_pushinteger(L, lo + 1);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_pushinteger(L, lo + 1);
+	return 2;
+}
+
+
+/** FFI Call InterFace
+ *
+ * For a cif with N arguments, the memory allocated is:
+ * 	ffi_cif cif;
+ *	ffi_type *atypes[N];
+ *	unsigned char argflags[N+1];
+ * and cif.arg_types points to atypes.  The userdata is a table whose array
+ * part is a sequence of argument types and field "ret" is the return type.
+ * argflags[i] tells how the i-th argument is passed (ARG_*), and
+ * argflags[N] is the union of all of them, plus the RET_* flags.
+ */
+
+#define ARG_OUT 1  /* pointer to per-function scratch, returned after call */
+#define ARG_VIEW 2  /* typed pointer, seen by callbacks as a view */
+#define RET_UNPACK 0x80  /* struct return as multiple values */
+
+#define cifsize_(n) (sizeof (ffi_cif) + sizeof (ffi_type *) * (n) + (n) + 1)
+#define argflags_(cif) \
+	((unsigned char *) ((ffi_type **) ((cif) + 1) + (cif)->nargs))
+
+/* Pointer arguments passed in a special way.  The userdata is a struct
+ * ptrarg with metatable "ffi_ptrarg", and the uservalue is the pointee type.
+ */
+struct ptrarg {
+	ffi_type *type;
+	size_t count;  /* number of elements pointed to */
+	unsigned char flag;
+};
+
+/* Declares an out-parameter of type T.
+ *
+ * In a cif, out(T) is passed as a pointer to storage that the bound
+ * function owns and reuses across calls.  The caller does not pass it;
+ * after the call, its value is returned following the return value.
+ * Scalars are converted to Lua values; structs are returned as the scratch
+ * object itself, which is overwritten by the next call.
+ */
+static
+int makeout(lua_State *L)
+{
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
+	struct ptrarg *pa;
+
+	luaL_argcheck(L, type->size > 0, 1, "type has no size");
+	pa = (struct ptrarg *) lua_newuserdata(L, sizeof *pa);
+	setmetatable_(L, ptrarg_tag);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	pa->type = type;
+	pa->count = 1;
+	pa->flag = ARG_OUT;
+	return 1;
+}
+
+/* Declares a typed pointer to n (default 1) elements of type T.
+ *
+ * In a cif, ptr(T, n) is passed as a pointer, exactly like ffi.pointer.
+ * A closure of the cif receives it as a view of the n elements, or nil if
+ * the pointer is NULL.  The view is valid only during the callback.
+ */
+static
+int makeptr(lua_State *L)
+{
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
+	lua_Integer n = luaL_optinteger(L, 2, 1);
+	struct ptrarg *pa;
+
+	luaL_argcheck(L, type->size > 0, 1, "type has no size");
+	luaL_argcheck(L, n > 0 && (size_t) n <= (size_t) -1 / type->size,
+		2, "invalid count");
+	pa = (struct ptrarg *) lua_newuserdata(L, sizeof *pa);
+	setmetatable_(L, ptrarg_tag);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	pa->type = type;
+	pa->count = (size_t) n;
+	pa->flag = ARG_VIEW;
+	return 1;
+}
+
+/* {ret = rtype; atypes...} -> cif
+ */
+static
+int makecif(lua_State *L)
+{
+	int abi;
+	ffi_cif *cif;
+	ffi_type *rtype = &ffi_type_void, **atypes;
+	unsigned char *argflags;
+	unsigned int len, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	len = lua_rawlen(L, 1);
+	cif = (ffi_cif *) lua_newuserdata(L, cifsize_(len));
+	setmetatable_(L, cif_tag);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	atypes = (ffi_type **) (cif + 1);
+	argflags = (unsigned char *) (atypes + len);
+	argflags[len] = 0;
+	if (lua_getfield(L, 1, "ret") != LUA_TNIL) {
+		rtype = (ffi_type *) checkudata_(L, -1, type_tag);
+	}
+	lua_getfield(L, 1, "ABI");
+	abi = luaL_optinteger(L, -1, FFI_DEFAULT_ABI);
+	lua_pop(L, 2);  /* rtype and ABI */
+	lua_getfield(L, 1, "unpack");
+	if (lua_toboolean(L, -1)) {
+		luaL_argcheck(L, rtype->type == FFI_TYPE_STRUCT ||
+			rtype->type == FFI_TYPE_COMPLEX, 1,
+			"unpack needs a struct or complex return type");
+		argflags[len] |= RET_UNPACK;
+	}
+	lua_pop(L, 1);
+	for (i = 0; i < len; i++) {
+		struct ptrarg *pa;
+
+		lua_rawgeti(L, 1, i+1);
+		if ((pa = (struct ptrarg *) testudata_(L, -1, ptrarg_tag))) {
+			atypes[i] = &ffi_type_pointer;
+			argflags[i] = pa->flag;
+			argflags[len] |= pa->flag;
+		} else {
+			atypes[i] = (ffi_type *) checkudata_(L, -1, type_tag);
+			argflags[i] = 0;
+		}
+		lua_pop(L, 1);
+	}
+	ffi_prep_cif(cif, abi, len, rtype, atypes);
+	return 1;
+}
+
+static
+void add_cif(luaL_Buffer *B, ffi_cif *cif)
+{
+	unsigned i;
+
+	add_type(B, cif->rtype);
+	if (cif->nargs == 0) {
+		luaL_addstring(B, "()");
+	} else {
+		luaL_addchar(B, '(');
+		i = 0;
+		for (;;) {
+			add_type(B, cif->arg_types[i]);
+			if (++i == cif->nargs) {
+				break;
+			}
+			luaL_addstring(B, ", ");
+		}
+		luaL_addchar(B, ')');
+	}
+}
+
+/* cif.__tostring */
+static
+int cif_tostr(lua_State *L)
+{
+	ffi_cif *cif = (ffi_cif *) checkudata_(L, 1, cif_tag);
+	luaL_Buffer B;
+
+	luaL_buffinit(L, &B);
+	lua_pushfstring(L, "ffi_cif: %p <", cif);
+	luaL_addstring(&B, lua_tostring(L, -1));
+	add_cif(&B, cif);
+	luaL_addchar(&B, '>');
+	luaL_pushresult(&B);
+	return 1;
+}
+
+
+/** Call tracing
+ *
+ * When tracing is on, every native call (through a bound function,
+ * ffi.callinto, a memo miss or a pipeline stage) and every callback into a
+ * closure appends a struct trace_rec to a process-wide ring buffer,
+ * overwriting the oldest records.  A memo hit makes no call and is not
+ * traced.  Writers take a slot number with an atomic increment, then claim
+ * the slot by swapping its sequence number for TRACE_BUSY, and publish it
+ * by storing its own sequence number last.  A writer that finds the slot
+ * busy, or has been lapped by a newer one, drops its record instead of
+ * waiting, so the ring needs no lock and a dump skips slots being written.
+ *
+ * The depth of a call is the number of traced calls in progress in the
+ * thread.  Each one records the stack address of its struct trace_frame,
+ * so that a call unwound by an error, whose frame lies at or below that of
+ * a later call, is no longer counted by it.
+ *
+ * ffi.tracedump writes the file:
+ * 	"LFTRACE1", uint32 nnames, uint32 nrecords (native byte order);
+ * 	nnames times: uint64 address, uint16 length, the name;
+ * 	nrecords times: struct trace_rec.
+ * sample/tracedecode.lua decodes it.
+ */
+
+enum { TRACE_CALL, TRACE_CALLBACK };
+
+struct trace_rec {
+	uint64_t seq;  /* slot number + 1, or TRACE_BUSY while being written */
+	uint64_t fn;  /* function or closure address */
+	uint64_t start;  /* in ns, from a monotonic clock */
+	uint64_t duration;  /* in ns */
+	uint32_t thread;  /* a number given to each thread */
+	uint16_t depth;  /* nesting of traced calls in the thread */
+	uint8_t kind;  /* TRACE_* */
+	uint8_t pad;
+};
+
+#define TRACE_DEFAULT_SIZE 65536
+#define TRACE_BUSY UINT64_MAX
+#define TRACE_MAXDEPTH 256  /* frames recorded per thread */
+
+#if defined(_MSC_VER)
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL _Thread_local
+#endif
+
+struct trace_ring {
+	size_t mask;  /* size - 1 */
+	struct trace_rec recs[1];
+};
+
+static atomic_int trace_on;
+static struct trace_ring *_Atomic trace_ring;  /* made once, never freed */
+static atomic_size_t trace_head;
+static atomic_uint trace_nthreads;
+static THREAD_LOCAL unsigned trace_thread;
+static THREAD_LOCAL unsigned trace_depth;
+static THREAD_LOCAL const void *trace_frames[TRACE_MAXDEPTH];
+
+struct trace_frame {
+	uint64_t start;
+	unsigned depth;
+};
+
+#define tracing_() atomic_load_explicit(&trace_on, memory_order_relaxed)
+
+static
+uint64_t trace_now_(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER c, f;
+
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return (uint64_t) ((double) c.QuadPart * 1e9 / (double) f.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static
+void trace_emit_(int kind, void *fn, uint64_t start, unsigned depth)
+{
+	uint64_t end = trace_now_();
+	struct trace_ring *ring = atomic_load_explicit(&trace_ring,
+		memory_order_acquire);
+	struct trace_rec *r;
+	_Atomic uint64_t *seq;
+	uint64_t old;
+	size_t i;
+
+	if (ring == NULL)
+		return;
+	if (trace_thread == 0)
+		trace_thread = atomic_fetch_add(&trace_nthreads, 1) + 1;
+	i = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+	r = &ring->recs[i & ring->mask];
+	seq = (_Atomic uint64_t *) &r->seq;
+	do {
+		old = atomic_load_explicit(seq, memory_order_relaxed);
+		/* another writer has the slot, or has lapped this one */
+		if (old == TRACE_BUSY || old > i + 1)
 			return;
+	} while (!atomic_compare_exchange_weak_explicit(seq, &old, TRACE_BUSY,
+		memory_order_relaxed, memory_order_relaxed));
+	/* the payload may not be written before the slot is claimed */
+	atomic_thread_fence(memory_order_release);
+	r->fn = (uint64_t) (uintptr_t) fn;
+	r->start = start;
+	r->duration = end - start;
+	r->thread = trace_thread;
+	r->depth = (uint16_t) depth;
+	r->kind = (uint8_t) kind;
+	r->pad = 0;
+	atomic_store_explicit(seq, i + 1, memory_order_release);
+}
+
+/* Starts a traced call; f must be a local of the caller */
+static
+void trace_enter_(struct trace_frame *f)
+{
+	unsigned depth = trace_depth;
+
+	/* drop the calls an error has unwound: their frames were deeper */
+	while (depth > 0 && depth <= TRACE_MAXDEPTH &&
+			(uintptr_t) trace_frames[depth-1] <= (uintptr_t) f)
+		depth--;
+	if (depth < TRACE_MAXDEPTH)
+		trace_frames[depth] = f;
+	f->depth = depth;
+	trace_depth = depth + 1;
+	f->start = trace_now_();
+}
+
+static
+void trace_leave_(struct trace_frame *f, int kind, void *fn)
+{
+	trace_depth = f->depth;
+	trace_emit_(kind, fn, f->start, f->depth);
+}
+
+/* Turns tracing on or off.
+ *
+ * Arg 1: boolean.
+ * Arg 2: (optional) the number of records in the ring, a power of 2;
+ *        only used when the ring is first made.
+ * Returns whether tracing was on.
+ */
+static
+int trace(lua_State *L)
+{
+	int on = lua_toboolean(L, 1);
+	lua_Integer n = luaL_optinteger(L, 2, TRACE_DEFAULT_SIZE);
+
+	luaL_checktype(L, 1, LUA_TBOOLEAN);
+	luaL_argcheck(L, n > 0 && (n & (n - 1)) == 0, 2,
+		"size must be a power of 2");
+	if (on && atomic_load(&trace_ring) == NULL) {
+		struct trace_ring *ring, *expected = NULL;
+
+		ring = (struct trace_ring *) calloc(1, sizeof *ring +
+			sizeof ring->recs[0] * (n - 1));
+		if (ring == NULL)
+			return luaL_error(L, "not enough memory");
+		ring->mask = n - 1;
+		if (!atomic_compare_exchange_strong(&trace_ring, &expected, ring))
+			free(ring);  /* another thread made one */
+	}
+	lua_pushboolean(L, atomic_exchange(&trace_on, on));
+	return 1;
+}
+
+static void (*tofn_(lua_State *L, int idx))(void);
+static int funccall(lua_State *L);
+
+/* Writes the names of bound functions in the table at idx */
+static
+uint32_t trace_names_(lua_State *L, int idx, FILE *fp)
+{
+	uint32_t n = 0;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING &&
+				lua_tocfunction(L, -1) == funccall &&
+				lua_getupvalue(L, -1, 2) != NULL) {
+			size_t len;
+			const char *name = lua_tolstring(L, -3, &len);
+			uint64_t addr = (uint64_t) (uintptr_t) tofn_(L, -1);
+			uint16_t len16 = len > 0xffff ? 0xffff : (uint16_t) len;
+
+			fwrite(&addr, sizeof addr, 1, fp);
+			fwrite(&len16, sizeof len16, 1, fp);
+			fwrite(name, 1, len16, fp);
+			n++;
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return n;
+}
+
+/* Dumps the trace to a file.
+ *
+ * Arg 1: path.
+ * Args 2...: (optional) tables of bound functions, such as those returned
+ *            by loadlib, whose names are written with the trace.
+ * Returns the number of records written.
+ */
+static
+int tracedump(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	struct trace_ring *ring = atomic_load(&trace_ring);
+	int top = lua_gettop(L), i;
+	uint32_t header[2] = {0, 0};
+	size_t head, k;
+	FILE *fp;
+
+	for (i = 2; i <= top; i++)
+		luaL_checktype(L, i, LUA_TTABLE);
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+		return luaL_fileresult(L, 0, path);
+	fwrite("LFTRACE1", 1, 8, fp);
+	fwrite(header, sizeof header, 1, fp);
+	for (i = 2; i <= top; i++)
+		header[0] += trace_names_(L, i, fp);
+	if (ring != NULL) {
+		head = atomic_load(&trace_head);
+		k = (head > ring->mask + 1) ? head - (ring->mask + 1) : 0;
+		for (; k < head; k++) {
+			struct trace_rec *p = &ring->recs[k & ring->mask], r;
+
+			/* skip the slot if it changes while being copied */
+			if (atomic_load_explicit((_Atomic uint64_t *) &p->seq,
+					memory_order_acquire) != k + 1)
+				continue;
+			r = *p;
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit((_Atomic uint64_t *) &p->seq,
+					memory_order_relaxed) != k + 1)
+				continue;
+			fwrite(&r, sizeof r, 1, fp);
+			header[1]++;
+		}
+	}
+	fseek(fp, 8, SEEK_SET);
+	fwrite(header, sizeof header, 1, fp);
+	if (ferror(fp) | fclose(fp))
+		return luaL_fileresult(L, 0, path);
+	lua_pushinteger(L, header[1]);
+	return 1;
+}
+
+/* Calling FFI functions
+ *
+ * It involves these steps:
+ * - Convert arguments into C values;
+ * - Invoke ffi_call();
+ * - Convert return value into Lua value.
+ */
+static int funccall(lua_State *L);
+
+/* Casts a Lua value to a C pointer */
+static
+int cast2ptr(lua_State *L, int idx, void **ptr)
+{
+	int ltype = lua_type(L, idx);
+	lua_CFunction fn;
+	void *p;
+
+	switch (ltype) {
+		case LUA_TNIL:
+			*ptr = NULL;
+			break;
+		case LUA_TSTRING:
+			/* FFI discards the `const' qualifier;
+			 * the C function must not change the string. */
+			*ptr = (void *) lua_tostring(L, idx);
+			break;
+		case LUA_TFUNCTION:
+			fn = lua_tocfunction(L, idx);
+			if (fn == funccall) {  /* FFI func, maybe from bind */
+				lua_getupvalue(L, idx, 2);
+				fn = (lua_CFunction) tofn_(L, -1);
+				lua_pop(L, 1);
+			} else if (lua_getupvalue(L, idx, 1)) {
+				/* C closure is not supported */
+				return 0;
+			}
+			/* Lua function is not supported; user should create
+			 * closure explicitly.
+			 */
+			if (fn == NULL)
+				return 0;
+			*ptr = (void *) fn;
+			break;
+		case LUA_TLIGHTUSERDATA:
+			*ptr = lua_touserdata(L, idx);
+			break;
+		case LUA_TUSERDATA:
+			p = lua_touserdata(L, idx);
+			if (testudata_(L, idx, closure_tag)) {
+				*ptr = ((struct closure *) p)->exec_addr;
+			} else if (testudata_(L, idx, view_tag)) {
+				*ptr = ((struct view *) p)->ptr;
+			} else {
+				*ptr = p;
+			}
+			break;
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+/* Casts of numeric values to C */
+#define CAST_CASE(ffi_type, c_type, ...) \
+	case ffi_type: *(c_type *) addr = n; return 1;
+#define COMPLEX_CASE(ffi_type, c_type, ...) \
+	case sizeof (c_type _Complex): *(c_type _Complex *) addr = n; return 1;
+#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
+# define COMPLEX_CASES \
+	case FFI_TYPE_COMPLEX: \
+		switch (type->size) { FLOAT_TYPE_LIST_(COMPLEX_CASE) }
+#else
+# define COMPLEX_CASES
+#endif
+
+#define CAST_TMPL(NAME, TYPE) \
+static int NAME(TYPE n, void *addr, ffi_type *type) \
+{ \
+	switch (type->type) { \
+		INT_TYPE_LIST_(CAST_CASE) \
+		FLOAT_TYPE_LIST_(CAST_CASE) \
+		COMPLEX_CASES \
+	} \
+	return 0; \
+}
+
+CAST_TMPL(castint2c, lua_Integer)
+CAST_TMPL(castnum2c, lua_Number)
+
+#undef CAST_TMPL
+#undef COMPLEX_CASES
+#undef COMPLEX_CASE
+#undef CAST_CASE
+
+/* Copies C value into a userdata at idx */
+static
+int cast2obj(lua_State *L, int idx, void *addr, ffi_type *type)
+{
+	size_t len;
+	void *obj = toobj_(L, idx, &len);
+	int rc;
+
+	if (obj == NULL)
+		return 0;
+	lua_getuservalue(L, idx);
+	rc = (totype_(L, -1) == type && len >= type->size);
+	lua_pop(L, 1);
+	if (rc)
+		memcpy(addr, obj, type->size);
+	return rc;
+}
+
+/* Casts a Lua value into C; returns 0 if it cannot be done */
+static
+int cast2c_(lua_State *L, int idx, void *addr, ffi_type *type)
+{
+	int ltype = lua_type(L, idx);
+	int rc = 0;
+
+	if (ltype == LUA_TBOOLEAN) {
+		rc = castint2c(lua_toboolean(L, idx), addr, type);
+	} else if (ltype == LUA_TNUMBER) {
+		rc = (lua_isinteger(L, idx)) ?
+			castint2c(lua_tointeger(L, idx), addr, type) :
+			castnum2c(lua_tonumber(L, idx), addr, type);
+	} else if (type->type == FFI_TYPE_POINTER) {
+		rc = cast2ptr(L, idx, (void **) addr);
+	} else if (type->type == FFI_TYPE_STRUCT ||
+			type->type == FFI_TYPE_COMPLEX) {
+		rc = cast2obj(L, idx, addr, type);
+	}
+	return rc;
+}
+
+/* Pushes the message "expect <type>, got <typename>" */
+static
+const char *push_casterror_(lua_State *L, int idx, ffi_type *type)
+{
+	luaL_Buffer B;
+
+	idx = lua_absindex(L, idx);
+	luaL_buffinit(L, &B);
+	luaL_addstring(&B, "expect ");
+	add_type(&B, type);
+	luaL_addstring(&B, ", got ");
+	luaL_addstring(&B, luaL_typename(L, idx));
+	luaL_pushresult(&B);
+	return lua_tostring(L, -1);
+}
+
+/* Casts a Lua value into C */
+static
+void cast2c(lua_State *L, int idx, void *addr, ffi_type *type)
+{
+	if (cast2c_(L, idx, addr, type) == 0) {
+		luaL_argerror(L, idx, push_casterror_(L, idx, type));
+	}
+}
+
+/* Casts numeric values from C */
+#define CASE(ffi_type, c_type, ...) \
+	case ffi_type: *n = *(c_type *) addr; return 1;
+#define CAST_TMPL(TYPE, NAME, TYPE_LIST) \
+static int NAME(TYPE *n, void *addr, ffi_type *type) \
+{ \
+	switch (type->type) { TYPE_LIST(CASE) } \
+	return 0; \
+}
+
+CAST_TMPL(lua_Integer, cast2lua_int, INT_TYPE_LIST_)
+CAST_TMPL(lua_Number, cast2lua_num, FLOAT_TYPE_LIST_)
+
+#undef CAST_TMPL
+#undef CASE
+
+/* Casts a C value into Lua */
+static
+void cast2lua(lua_State *L, void *addr, ffi_type *type)
+{
+	lua_Integer i;
+	lua_Number n;
+	void *p;
+
+	switch (type->type) {
+#define CASE(ffi_type, c_type, ...) case ffi_type:
+	INT_TYPE_LIST_(CASE)
+		if (cast2lua_int(&i, addr, type)) {
+			lua_pushinteger(L, i);
+			return;
+		}
+		break;
+	FLOAT_TYPE_LIST_(CASE)
+		if (cast2lua_num(&n, addr, type)) {
+			lua_pushnumber(L, n);
+			return;
+		}
+		break;
+#undef CASE
+	case FFI_TYPE_POINTER:
+		p = *(void **) addr;
+		(p == NULL) ? lua_pushnil(L) : lua_pushlightuserdata(L, p);
+		return;
+	}
+	luaL_error(L, "cannot cast result to lua value");
+}
+
+/* For extra values in a vararg call, use these default types.
+ *
+ * Note: it's currently impossible to pass an integer longer than int
+ * in vararg, so printf("%ld") won't work.
+ */
+static
+ffi_type *default_type_(lua_State *L, int idx)
+{
+	int ltype = lua_type(L, idx);
+
+	switch (ltype) {
+		case LUA_TNIL: /* as NULL pointer */
+		case LUA_TSTRING: /* as const char * */
+		case LUA_TLIGHTUSERDATA:
+		case LUA_TUSERDATA:
+			return &ffi_type_pointer;
+		case LUA_TBOOLEAN: /* as int */
+			return &ffi_type_sint;
+		case LUA_TNUMBER:
+			return (lua_isinteger(L, idx)) ?
+				&ffi_type_sint : &ffi_type_double;
+		default:
+			return &ffi_type_void;
+	}
+}
+
+/* Returns the address of the C function behind a bound function,
+ * given its second upvalue: a C function from loadlib, or a light
+ * userdata from bind. */
+static
+void (*tofn_(lua_State *L, int idx))(void)
+{
+	if (lua_islightuserdata(L, idx))
+		return (void (*)(void)) lua_touserdata(L, idx);
+	return (void (*)(void)) lua_tocfunction(L, idx);
+}
+
+/* Pushes the scalar fields of the struct at addr, in preorder, or the
+ * real and imaginary parts of a complex.  Returns the number of values.
+ */
+static
+int unpack_(lua_State *L, char *addr, ffi_type *type)
+{
+	ffi_type **t;
+	size_t *offsets;
+	int n = 0;
+
+	switch (type->type) {
+	case FFI_TYPE_STRUCT:
+		for (t = type->elements; *t != NULL; t++)
+			;
+		offsets = (size_t *) (t + 1);
+		for (t = type->elements; *t != NULL; t++)
+			n += unpack_(L, addr + offsets[t - type->elements], *t);
+		return n;
+	case FFI_TYPE_COMPLEX:
+		luaL_checkstack(L, 2, "too many fields");
+		cast2lua(L, addr, type->elements[0]);
+		cast2lua(L, addr + type->size / 2, type->elements[0]);
+		return 2;
+	}
+	luaL_checkstack(L, 1, "too many fields");
+	cast2lua(L, addr, type);
+	return 1;
+}
+
+/* Calls fn through the cif at cif_idx.
+ *
+ * The nargs Lua arguments start at base.  scratch_idx is the table of
+ * out-parameter storage of the function (or nil).  If rdest is not NULL,
+ * a struct return value is stored there instead of in a new object.
+ * Returns the number of values pushed: the return value (unless it is void
+ * or stored in rdest), followed by the out-parameters.
+ */
+static
+int callcif_(lua_State *L, int cif_idx, void (*fn)(void), int scratch_idx,
+	int base, unsigned nargs, void *rdest)
+{
+	ffi_cif *cif = tocif_(L, cif_idx);
+	unsigned char *argflags = argflags_(cif);
+	ffi_type *rtype = cif->rtype, **atypes = NULL;
+	void **args;
+	void *rvalue = NULL;
+	ffi_status status = FFI_OK;
+	unsigned nfixedargs = cif->nargs, nout = 0;
+	unsigned ntotalargs, i;
+	int idx = base, nret = 1;
+
+	if (argflags[nfixedargs] & ARG_OUT) {
+		for (i = 0; i < nfixedargs; i++) {
+			nout += (argflags[i] & ARG_OUT) != 0;
+		}
+	}
+	ntotalargs = nargs + nout;
+	args = (void **) alloca(sizeof args[0] * ntotalargs);
+	if (ntotalargs > nfixedargs) {
+		atypes = (ffi_type **) alloca(sizeof atypes[0] * ntotalargs);
+	} else if (ntotalargs < nfixedargs) {
+		return luaL_error(L, "expect %d arguments, got %d",
+			nfixedargs - nout, nargs);
+	}
+	for (i = 0; i < ntotalargs; i++) {
+		ffi_type *type = (i < nfixedargs) ?
+			cif->arg_types[i] : default_type_(L, idx);
+		if (atypes != NULL) {
+			atypes[i] = type;
+		}
+		args[i] = alloca(type->size);
+		if (i < nfixedargs && (argflags[i] & ARG_OUT)) {
+			lua_rawgeti(L, scratch_idx, i+1);
+			*(void **) args[i] = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			continue;
+		}
+		cast2c(L, idx++, args[i], type);
+	}
+	if (ntotalargs > nfixedargs) {
+		cif = (ffi_cif *) alloca(sizeof *cif);
+		status = ffi_prep_cif_var(cif, FFI_DEFAULT_ABI, nfixedargs,
+			ntotalargs, rtype, atypes);
+	}
+	if (status != FFI_OK) {
+		return luaL_error(L, "failed to prepare cif");
+	}
+	assert(cif->rtype == rtype);
+	switch (rtype->type) {
+		case FFI_TYPE_VOID:
+			ffi_call(cif, fn, NULL, args);
+			nret = 0;
+			break;
+		case FFI_TYPE_STRUCT:
+		case FFI_TYPE_COMPLEX:
+			if (rdest != NULL) {
+				/* libffi may store a whole ffi_arg */
+				rvalue = (rtype->size < sizeof (ffi_arg)) ?
+					alloca(sizeof (ffi_arg)) : rdest;
+				ffi_call(cif, fn, rvalue, args);
+				if (rvalue != rdest)
+					memcpy(rdest, rvalue, rtype->size);
+				nret = 0;
+				break;
+			}
+			if (argflags[nfixedargs] & RET_UNPACK) {
+				rvalue = alloca(rtype->size > sizeof (ffi_arg) ?
+					rtype->size : sizeof (ffi_arg));
+				ffi_call(cif, fn, rvalue, args);
+				nret = unpack_(L, (char *) rvalue, rtype);
+				break;
+			}
+			lua_getuservalue(L, cif_idx);
+			lua_getfield(L, -1, "ret");
+			rvalue = lua_newuserdata(L,
+				(rtype->size > sizeof (ffi_arg) ?
+					rtype->size : sizeof (ffi_arg)));
+			initobj_(L, lua_gettop(L) - 1);
+			track_(L, MEM_RETURN);
+			lua_replace(L, -3);
+			lua_pop(L, 1);
+			ffi_call(cif, fn, rvalue, args);
+			break;
+		default:
+			if (rtype->size > sizeof (ffi_arg)) {
+				return luaL_error(L, "return value not supported");
+			}
+			rvalue = (ffi_arg *) alloca(sizeof (ffi_arg));
+			ffi_call(cif, fn, rvalue, args);
+			cast2lua(L, rvalue, rtype);
+	}
+	if (nout == 0)
+		return nret;
+	luaL_checkstack(L, nout, NULL);
+	for (i = 0; i < nfixedargs; i++) {
+		ffi_type *type;
+
+		if (!(argflags[i] & ARG_OUT))
+			continue;
+		lua_rawgeti(L, scratch_idx, i+1);
+		lua_getuservalue(L, -1);
+		type = totype_(L, -1);
+		lua_pop(L, 1);
+		if (type->type != FFI_TYPE_STRUCT &&
+				type->type != FFI_TYPE_COMPLEX) {
+			cast2lua(L, lua_touserdata(L, -1), type);
+			lua_replace(L, -2);
+		}
+	}
+	return nret + nout;
+}
+
+/* funccall without tracing */
+static
+int funccall_(lua_State *L)
+{
+	void (*fn)(void) = tofn_(L, lua_upvalueindex(2));
+
+	if (fn == NULL) {
+		return luaL_error(L, "expect function, got %s",
+			luaL_typename(L, lua_upvalueindex(2)));
+	}
+	/* the upvalue was checked when the function was made */
+	return callcif_(L, lua_upvalueindex(1), fn, lua_upvalueindex(3),
+		1, lua_gettop(L), NULL);
+}
+
+/* Upvalues: cif, C function, table of out-parameter storage (or nil) */
+static
+int funccall(lua_State *L)
+{
+	struct trace_frame tf;
+	int nret;
+
+	if (!tracing_())
+		return funccall_(L);
+	trace_enter_(&tf);
+	nret = funccall_(L);
+	trace_leave_(&tf, TRACE_CALL, (void *) tofn_(L, lua_upvalueindex(2)));
+	return nret;
+}
+
+/* Makes a function from the cif and the function address at stack top,
+ * replacing both.
+ */
+static
+void pushfunc_(lua_State *L)
+{
+	ffi_cif *cif = tocif_(L, -2);
+	unsigned char *argflags = argflags_(cif);
+	unsigned i;
+
+	if (!(argflags[cif->nargs] & ARG_OUT)) {
+		lua_pushnil(L);
+		lua_pushcclosure(L, funccall, 3);
+		return;
+	}
+	lua_newtable(L);
+	lua_getuservalue(L, -3);
+	for (i = 0; i < cif->nargs; i++) {
+		struct ptrarg *pa;
+
+		if (!(argflags[i] & ARG_OUT))
+			continue;
+		lua_rawgeti(L, -1, i+1);
+		pa = (struct ptrarg *) lua_touserdata(L, -1);
+		lua_getuservalue(L, -1);
+		lua_newuserdata(L, pa->type->size);
+		initobj_(L, lua_gettop(L) - 1);
+		track_(L, MEM_OTHER);
+		lua_rawseti(L, -5, i+1);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+	lua_pushcclosure(L, funccall, 3);
+}
+
+/* Calls a function that returns a struct, storing the return value
+ * into an existing object.
+ *
+ * Args: fn dest args...
+ * Returns dest, followed by the out-parameters if any.
+ */
+static
+int callinto(lua_State *L)
+{
+	int top = lua_gettop(L), nret;
+	ffi_cif *cif;
+	void *dest;
+	size_t len;
+	void (*fn)(void);
+	struct trace_frame tf;
+
+	luaL_argcheck(L, lua_tocfunction(L, 1) == funccall, 1,
+		"expect an ffi function");
+	dest = checkobj_(L, 2, &len);
+	lua_getupvalue(L, 1, 1);  /* top+1: cif */
+	lua_getupvalue(L, 1, 2);  /* top+2: C function */
+	lua_getupvalue(L, 1, 3);  /* top+3: out-parameter storage */
+	cif = tocif_(L, top+1);
+	fn = tofn_(L, top+2);
+	luaL_argcheck(L, cif->rtype->type == FFI_TYPE_STRUCT ||
+		cif->rtype->type == FFI_TYPE_COMPLEX, 1,
+		"function does not return a struct");
+	lua_getuservalue(L, 2);
+	luaL_argcheck(L, totype_(L, -1) == cif->rtype &&
+		len >= cif->rtype->size, 2, "type mismatch");
+	lua_pushvalue(L, 2);
+	if (!tracing_())
+		return 1 + callcif_(L, top+1, fn, top+3, 3, top - 2, dest);
+	trace_enter_(&tf);
+	nret = callcif_(L, top+1, fn, top+3, 3, top - 2, dest);
+	trace_leave_(&tf, TRACE_CALL, (void *) fn);
+	return 1 + nret;
+}
+
+/** Atomic operations
+ *
+ * ffi.atomic_*(o, k, ...) operate on the integer element or field o[k] of
+ * an object or view, which must be naturally aligned.  The optional last
+ * argument is the memory order: "relaxed", "consume", "acquire",
+ * "release", "acq_rel" or "seq_cst" (the default).
+ */
+
+enum {
+	ATOMIC_LOAD, ATOMIC_STORE, ATOMIC_ADD, ATOMIC_EXCHANGE, ATOMIC_CAS,
+};
+
+static const char *const atomic_order_names[] = {
+	"relaxed", "consume", "acquire", "release", "acq_rel", "seq_cst", NULL,
+};
+
+static const memory_order atomic_orders[] = {
+	memory_order_relaxed, memory_order_consume, memory_order_acquire,
+	memory_order_release, memory_order_acq_rel, memory_order_seq_cst,
+};
+
+union atomic_value {
+	uint8_t u8;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+};
+
+/* Returns the address of o[k] and stores its type in *type.
+ * The stack is left as it was; the type is kept alive by o.
+ */
+static
+void *atomic_addr_(lua_State *L, ffi_type **type)
+{
+	size_t offset, len;
+	int top = lua_gettop(L);
+	char *obj = (char *) checkobj_(L, 1, &len);
+	ffi_type *t = push_type_offset_(L, 1, 2, &offset);
+
+	luaL_argcheck(L, obj != NULL && offset + t->size <= len,
+		2, "access out of bound");
+	switch (t->type) {
+#define CASE(ffi_type, ...) case ffi_type:
+	INT_TYPE_LIST_(CASE)
+#undef CASE
+		break;
+	default:
+		luaL_argerror(L, 2, "not an integer");
+	}
+	luaL_argcheck(L, (uintptr_t) (obj + offset) % t->size == 0,
+		2, "misaligned");
+	lua_settop(L, top);
+	*type = t;
+	return obj + offset;
+}
+
+static
+void atomic_tovalue_(lua_State *L, int idx, union atomic_value *v,
+	ffi_type *type)
+{
+	castint2c(luaL_checkinteger(L, idx), v, type);
+}
+
+#define ATOMIC_CASE(bits) \
+	case bits/8: { \
+		_Atomic uint##bits##_t *p = (_Atomic uint##bits##_t *) addr; \
+		switch (op) { \
+		case ATOMIC_LOAD: \
+			v->u##bits = atomic_load_explicit(p, mo); \
+			return 1; \
+		case ATOMIC_STORE: \
+			atomic_store_explicit(p, v->u##bits, mo); \
+			return 1; \
+		case ATOMIC_ADD: \
+			v->u##bits = atomic_fetch_add_explicit(p, v->u##bits, mo); \
+			return 1; \
+		case ATOMIC_EXCHANGE: \
+			v->u##bits = atomic_exchange_explicit(p, v->u##bits, mo); \
+			return 1; \
+		case ATOMIC_CAS: \
+			return atomic_compare_exchange_strong_explicit(p, \
+				&expected->u##bits, v->u##bits, mo, fail); \
+		} \
+		break; \
+	}
+
+/* Performs op on size bytes at addr.  The operand is in *v, which
+ * receives the old value (for ATOMIC_CAS, *expected receives it).
+ * Returns 0 if a compare-and-swap fails, or 1.
+ */
+static
+int atomic_do_(int op, void *addr, size_t size, union atomic_value *v,
+	union atomic_value *expected, memory_order mo)
+{
+	memory_order fail = (mo == memory_order_release) ?
+		memory_order_relaxed : (mo == memory_order_acq_rel) ?
+		memory_order_acquire : mo;
+
+	switch (size) {
+	ATOMIC_CASE(8)
+	ATOMIC_CASE(16)
+	ATOMIC_CASE(32)
+	ATOMIC_CASE(64)
+	}
+	return 1;
+}
+
+#undef ATOMIC_CASE
+
+static
+int atomic_op_(lua_State *L, int op, int order_idx)
+{
+	ffi_type *type;
+	void *addr = atomic_addr_(L, &type);
+	int order = luaL_checkoption(L, order_idx, "seq_cst",
+		atomic_order_names);
+	memory_order mo = atomic_orders[order];
+	union atomic_value v, expected;
+	int ok;
+
+	if (op == ATOMIC_LOAD) {
+		luaL_argcheck(L, mo != memory_order_release &&
+			mo != memory_order_acq_rel, order_idx,
+			"invalid order for load");
+	} else if (op == ATOMIC_STORE) {
+		luaL_argcheck(L, mo != memory_order_consume &&
+			mo != memory_order_acquire &&
+			mo != memory_order_acq_rel, order_idx,
+			"invalid order for store");
+	}
+	if (op == ATOMIC_CAS) {
+		atomic_tovalue_(L, 3, &expected, type);
+		atomic_tovalue_(L, 4, &v, type);
+	} else if (op != ATOMIC_LOAD) {
+		atomic_tovalue_(L, 3, &v, type);
+	}
+	ok = atomic_do_(op, addr, type->size, &v, &expected, mo);
+	switch (op) {
+	case ATOMIC_STORE:
+		return 0;
+	case ATOMIC_CAS:
+		lua_pushboolean(L, ok);
+		cast2lua(L, &expected, type);
+		return 2;
+	}
+	cast2lua(L, &v, type);
+	return 1;
+}
+
+/* atomic_load(o, k [, order]) -> value */
+static
+int atomic_load_(lua_State *L)
+{
+	return atomic_op_(L, ATOMIC_LOAD, 3);
+}
+
+/* atomic_store(o, k, value [, order]) */
+static
+int atomic_store_(lua_State *L)
+{
+	return atomic_op_(L, ATOMIC_STORE, 4);
+}
+
+/* atomic_add(o, k, delta [, order]) -> old value */
+static
+int atomic_add_(lua_State *L)
+{
+	return atomic_op_(L, ATOMIC_ADD, 4);
+}
+
+/* atomic_exchange(o, k, value [, order]) -> old value */
+static
+int atomic_exchange_(lua_State *L)
+{
+	return atomic_op_(L, ATOMIC_EXCHANGE, 4);
+}
+
+/* atomic_cas(o, k, expected, desired [, order]) -> swapped, old value */
+static
+int atomic_cas_(lua_State *L)
+{
+	return atomic_op_(L, ATOMIC_CAS, 5);
+}
+
+
+/** Pipelines
+ *
+ * A pipeline runs a chain of bound functions over a chunk of data in one
+ * call.  Each stage is a table {fn, args...; out = obj, len = "ret"}:
+ * - fn is a function made by loadlib;
+ * - args are the arguments, where ffi.input and ffi.inlen stand for the
+ *   stage's input (the output of the previous stage, or the chunk given to
+ *   the pipeline) and its length in bytes, and ffi.output and ffi.outsize
+ *   for the stage's output buffer and its size;
+ * - out is the output buffer, an object or a view reused for every chunk
+ *   (a view is looked at again on each call, and must still be valid); a
+ *   stage without one passes its input on to the next stage;
+ * - len tells the length of the output: "ret" takes the return value of
+ *   the function, which may not exceed the size of the output buffer, or
+ *   that of the input without one; by default it is the length of the input,
+ *   which must then fit in the output buffer.
+ * Other arguments are converted once, when the pipeline is made.
+ */
+
+enum {
+	PIPE_CONST, PIPE_INPUT, PIPE_INLEN, PIPE_OUTPUT, PIPE_OUTSIZE,
+};
+
+static const char pipe_input[] = "ffi.input";
+static const char pipe_inlen[] = "ffi.inlen";
+static const char pipe_output[] = "ffi.output";
+static const char pipe_outsize[] = "ffi.outsize";
+
+struct pipe_stage {
+	ffi_cif *cif;
+	void (*fn)(void);
+	void **args;  /* argument values */
+	unsigned char *kinds;  /* PIPE_* of each argument */
+	char *out;  /* output buffer, or NULL */
+	size_t outsize;
+	struct view *outview;  /* the view out was taken from, or NULL */
+	int lenret;  /* the return value is the output length */
+};
+
+struct pipeline {
+	unsigned nstages;
+	struct pipe_stage stages[1];
+};
+
+static
+int pipe_kind_(lua_State *L, int idx)
+{
+	const void *p = lua_touserdata(L, idx);
+
+	if (!lua_islightuserdata(L, idx))
+		return PIPE_CONST;
+	return (p == pipe_input) ? PIPE_INPUT :
+		(p == pipe_inlen) ? PIPE_INLEN :
+		(p == pipe_output) ? PIPE_OUTPUT :
+		(p == pipe_outsize) ? PIPE_OUTSIZE : PIPE_CONST;
+}
+
+/* Compiles the stage table at stage_idx into st.  The values the stage
+ * refers to are appended to the table at keep_idx.
+ */
+static
+void pipe_compile_(lua_State *L, struct pipe_stage *st, int stage_idx,
+	int keep_idx)
+{
+	ffi_cif *cif;
+	unsigned i, nargs;
+	size_t size;
+	char *p;
+
+	luaL_checktype(L, stage_idx, LUA_TTABLE);
+	lua_rawgeti(L, stage_idx, 1);
+	if (lua_tocfunction(L, -1) != funccall)
+		luaL_error(L, "stage must start with an ffi function");
+	lua_getupvalue(L, -1, 1);
+	cif = st->cif = tocif_(L, -1);
+	lua_getupvalue(L, -2, 2);
+	st->fn = tofn_(L, -1);
+	lua_pop(L, 2);
+	/* the function keeps its cif and library alive */
+	lua_rawseti(L, keep_idx, lua_rawlen(L, keep_idx) + 1);
+	nargs = cif->nargs;
+	if (argflags_(cif)[nargs] & ARG_OUT)
+		luaL_error(L, "out-parameters are not supported in a pipeline");
+	if (lua_rawlen(L, stage_idx) != nargs + 1)
+		luaL_error(L, "stage expects %d arguments", nargs);
+	if (cif->rtype->type == FFI_TYPE_STRUCT ||
+			cif->rtype->type == FFI_TYPE_COMPLEX ||
+			cif->rtype->size > sizeof (ffi_arg))
+		luaL_error(L, "return value not supported");
+
+	st->out = NULL;
+	st->outsize = 0;
+	st->outview = NULL;
+	if (lua_getfield(L, stage_idx, "out") != LUA_TNIL) {
+		st->out = (char *) checkobj_(L, -1, &st->outsize);
+		if (st->out == NULL)
+			luaL_error(L, "output buffer is not valid");
+		st->outview = (struct view *) testudata_(L, -1, view_tag);
+		lua_rawseti(L, keep_idx, lua_rawlen(L, keep_idx) + 1);
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_getfield(L, stage_idx, "len");
+	st->lenret = 0;
+	if (!lua_isnil(L, -1)) {
+		if (strcmp(luaL_checkstring(L, -1), "ret") != 0)
+			luaL_error(L, "invalid len '%s'", lua_tostring(L, -1));
+		switch (cif->rtype->type) {
+#define CASE(ffi_type, ...) case ffi_type:
+		INT_TYPE_LIST_(CASE)
+#undef CASE
+			break;
+		default:
+			luaL_error(L, "len = \"ret\" needs an integer return");
+		}
+		st->lenret = 1;
+	}
+	lua_pop(L, 1);
+
+	/* argument values and kinds, in one block */
+	size = (sizeof (void *) + 1) * nargs;
+	for (i = 0; i < nargs; i++)
+		size += cif->arg_types[i]->size + sizeof (ffi_arg);
+	p = (char *) lua_newuserdata(L, size);
+	lua_rawseti(L, keep_idx, lua_rawlen(L, keep_idx) + 1);
+	st->args = (void **) p;
+	p += sizeof (void *) * nargs;
+	for (i = 0; i < nargs; i++) {
+		ffi_type *type = cif->arg_types[i];
+
+		/* align each value for any scalar type */
+		size = (size_t) (p - (char *) st->args) % sizeof (ffi_arg);
+		if (size != 0)
+			p += sizeof (ffi_arg) - size;
+		st->args[i] = p;
+		p += type->size;
+	}
+	st->kinds = (unsigned char *) p;
+	for (i = 0; i < nargs; i++) {
+		ffi_type *type = cif->arg_types[i];
+		int kind;
+
+		lua_rawgeti(L, stage_idx, i+2);
+		kind = st->kinds[i] = pipe_kind_(L, -1);
+		if ((kind == PIPE_INPUT || kind == PIPE_OUTPUT) &&
+				type->type != FFI_TYPE_POINTER)
+			luaL_error(L, "argument %d must be a pointer", i+1);
+		if ((kind == PIPE_OUTPUT || kind == PIPE_OUTSIZE) &&
+				st->out == NULL)
+			luaL_error(L, "stage has no output buffer");
+		if (kind == PIPE_INLEN || kind == PIPE_OUTSIZE) {
+			switch (type->type) {
+#define CASE(ffi_type, ...) case ffi_type:
+			INT_TYPE_LIST_(CASE)
+#undef CASE
+				break;
+			default:
+				luaL_error(L, "argument %d must be an integer", i+1);
+			}
+		}
+		if (kind == PIPE_CONST) {
+			cast2c(L, -1, st->args[i], type);
+			lua_rawseti(L, keep_idx, lua_rawlen(L, keep_idx) + 1);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+}
+
+/* Runs the pipeline.
+ *
+ * Arg 1: the chunk: an object, a view, a string or a light userdata.
+ * Arg 2: (optional) its length in bytes; needed for a light userdata.
+ * Returns the length of the final output, followed by the return value of
+ * each stage (nil for void).
+ */
+static
+int pipeline_call(lua_State *L)
+{
+	struct pipeline *pl = (struct pipeline *) checkudata_(L, 1,
+		pipeline_tag);
+	ffi_arg *rvalues;
+	char *in;
+	size_t inlen, len;
+	unsigned i, j;
+
+	if ((in = (char *) toobj_(L, 2, &inlen)) != NULL) {
+		len = luaL_optinteger(L, 3, inlen);
+		luaL_argcheck(L, len <= inlen, 3, "length out of bound");
+		inlen = len;
+	} else if (lua_type(L, 2) == LUA_TSTRING) {
+		in = (char *) lua_tolstring(L, 2, &inlen);
+		len = luaL_optinteger(L, 3, inlen);
+		luaL_argcheck(L, len <= inlen, 3, "length out of bound");
+		inlen = len;
+	} else {
+		luaL_argcheck(L, lua_islightuserdata(L, 2), 2,
+			"expect ffi_obj, string or light userdata");
+		in = (char *) lua_touserdata(L, 2);
+		inlen = luaL_checkinteger(L, 3);
+	}
+	luaL_checkstack(L, pl->nstages + 1, NULL);
+	rvalues = (ffi_arg *) alloca(sizeof *rvalues * pl->nstages);
+	for (i = 0; i < pl->nstages; i++) {
+		struct pipe_stage *st = &pl->stages[i];
+		ffi_cif *cif = st->cif;
+		lua_Integer n;
+
+		if (st->outview != NULL) {  /* may be detached or moved */
+			st->out = st->outview->ptr;
+			st->outsize = st->outview->size;
+			if (st->out == NULL)
+				return luaL_error(L, "stage %d: output buffer is "
+					"no longer valid", i+1);
+		}
+		if (st->out != NULL && !st->lenret && inlen > st->outsize)
+			return luaL_error(L, "stage %d: input exceeds its output "
+				"buffer", i+1);
+		for (j = 0; j < cif->nargs; j++) {
+			void *arg = st->args[j];
+
+			switch (st->kinds[j]) {
+			case PIPE_INPUT:
+				*(void **) arg = in;
+				break;
+			case PIPE_OUTPUT:
+				*(void **) arg = st->out;
+				break;
+			case PIPE_INLEN:
+				castint2c(inlen, arg, cif->arg_types[j]);
+				break;
+			case PIPE_OUTSIZE:
+				castint2c(st->outsize, arg, cif->arg_types[j]);
+				break;
+			}
+		}
+		if (tracing_()) {
+			struct trace_frame tf;
+
+			trace_enter_(&tf);
+			ffi_call(cif, st->fn, &rvalues[i], st->args);
+			trace_leave_(&tf, TRACE_CALL, (void *) st->fn);
+		} else {
+			ffi_call(cif, st->fn, &rvalues[i], st->args);
+		}
+		len = inlen;
+		if (st->lenret) {
+			cast2lua_int(&n, &rvalues[i], cif->rtype);
+			if (n < 0)
+				return luaL_error(L, "stage %d failed (%d)",
+					i+1, (int) n);
+			len = n;
+		}
+		if (st->out != NULL) {
+			if (len > st->outsize)
+				return luaL_error(L, "stage %d overflows its "
+					"output buffer", i+1);
+			in = st->out;
+		} else if (len > inlen) {
+			return luaL_error(L, "stage %d returned a length out of "
+				"bound", i+1);
+		}
+		inlen = len;
+	}
+	lua_pushinteger(L, inlen);
+	for (i = 0; i < pl->nstages; i++) {
+		ffi_type *rtype = pl->stages[i].cif->rtype;
+
+		if (rtype->type == FFI_TYPE_VOID)
+			lua_pushnil(L);
+		else
+			cast2lua(L, &rvalues[i], rtype);
+	}
+	return 1 + pl->nstages;
+}
+
+/* pipeline.__tostring */
+static
+int pipeline_tostr(lua_State *L)
+{
+	struct pipeline *pl = (struct pipeline *) checkudata_(L, 1,
+		pipeline_tag);
+
+	lua_pushfstring(L, "ffi_pipeline: %p (%d stages)", pl,
+		(int) pl->nstages);
+	return 1;
+}
+
+/* Makes a pipeline from a sequence of stages (see above).
+ * The pipeline is called as pl(chunk [, len]).
+ */
+static
+int makepipeline(lua_State *L)
+{
+	struct pipeline *pl;
+	unsigned n, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_rawlen(L, 1);
+	luaL_argcheck(L, n > 0, 1, "no stages");
+	pl = (struct pipeline *) lua_newuserdata(L,
+		sizeof *pl + sizeof pl->stages[0] * (n - 1));
+	pl->nstages = 0;
+	setmetatable_(L, pipeline_tag);
+	lua_newtable(L);  /* values referred to by the stages */
+	lua_pushvalue(L, -1);
+	lua_setuservalue(L, -3);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i+1);
+		pipe_compile_(L, &pl->stages[i], lua_gettop(L), lua_gettop(L) - 1);
+		lua_pop(L, 1);
+	}
+	pl->nstages = n;
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* Pushes the function bound to address p through the cif at cif_idx.
+ * Bound functions are cached in registry[bind_tag][cif][p], weakly, so
+ * that a function nobody holds lets go of the closure it anchors.
+ */
+static
+void bind_(lua_State *L, int cif_idx, void *p)
+{
+	cif_idx = lua_absindex(L, cif_idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, bind_tag);
+	lua_pushvalue(L, cif_idx);
+	if (lua_rawget(L, -2) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, cif_idx);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	if (lua_rawgetp(L, -1, p) != LUA_TFUNCTION) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, cif_idx);
+		lua_pushlightuserdata(L, p);
+		pushfunc_(L);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, -3, p);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Binds a function pointer.
+ *
+ * Arg 1: cif.
+ * Arg 2: the function: a light userdata, a closure or a function made by
+ *        loadlib or bind, which the result keeps alive.
+ * Returns a function like those made by loadlib.  Binding the same address
+ * to the same cif again returns the same function.
+ */
+static
+int bind(lua_State *L)
+{
+	void *p = NULL;
+
+	checkudata_(L, 1, cif_tag);
+	lua_settop(L, 2);
+	if (lua_islightuserdata(L, 2) || testudata_(L, 2, closure_tag) ||
+			lua_tocfunction(L, 2) == funccall)
+		cast2ptr(L, 2, &p);
+	luaL_argcheck(L, p != NULL, 2, "expect a function pointer");
+	bind_(L, 1, p);
+	if (!lua_islightuserdata(L, 2))
+		anchor_(L, -1, 2);
+	return 1;
+}
+
+/* Binds the function pointers in a struct.
+ *
+ * Arg 1: the struct: an object or a view of the struct type, or a light
+ *        userdata.
+ * Arg 2: the struct type.
+ * Arg 3: a table mapping field names to cifs.
+ * Returns a table mapping the same names to bound functions; NULL
+ * pointers are left out.
+ */
+static
+int vtable(lua_State *L)
+{
+	size_t len, offset;
+	char *base;
+	ffi_type *type;
+
+	checkudata_(L, 2, type_tag);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_settop(L, 3);
+	if (lua_islightuserdata(L, 1)) {
+		base = (char *) lua_touserdata(L, 1);
+		luaL_argcheck(L, base != NULL, 1, "NULL pointer");
+		len = (size_t) -1;
+	} else {
+		base = (char *) checkobj_(L, 1, &len);
+		lua_getuservalue(L, 1);
+		luaL_argcheck(L, lua_rawequal(L, -1, 2), 1, "type mismatch");
+		lua_pop(L, 1);
+	}
+	lua_newtable(L);  /* 4: result */
+	lua_pushnil(L);
+	while (lua_next(L, 3) != 0) {
+		/* 5: name 6: cif */
+		void *p;
+
+		if (testudata_(L, 6, cif_tag) == NULL)
+			return luaL_error(L, "expect cif for '%s', got %s",
+				luaL_tolstring(L, 5, NULL), luaL_typename(L, 6));
+		lua_pushvalue(L, 2);
+		offset = field_(L, 5);
+		type = totype_(L, -1);
+		lua_pop(L, 1);
+		if (type->type != FFI_TYPE_POINTER)
+			return luaL_error(L, "field '%s' is not a pointer",
+				luaL_tolstring(L, 5, NULL));
+		luaL_argcheck(L, offset + type->size <= len, 1,
+			"struct out of bound");
+		p = *(void **) (base + offset);
+		if (p != NULL) {
+			lua_pushvalue(L, 5);
+			bind_(L, 6, p);
+			lua_rawset(L, 4);
+		}
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/** Memoization
+ *
+ * ffi.memoize(fn, {capacity = n}) wraps a bound function of a pure C
+ * function with a cache of its last results.  The arguments are converted
+ * into one zeroed block, at the offsets ffi_call reads them from, and the
+ * block is the key.  Entries live in an array of n, evicted with the CLOCK
+ * algorithm, and are found through an open-addressing index of at least 2n
+ * slots, each holding an entry number + 1 (0 if empty).
+ *
+ * An entry is a struct memo_entry, the return value and the key, each
+ * aligned to MEMO_ALIGN.
+ */
+
+#define MEMO_ALIGN 16
+#define memo_align_(n) (((n) + MEMO_ALIGN - 1) & ~(size_t) (MEMO_ALIGN - 1))
+
+struct memo_entry {
+	uint32_t hash;
+	unsigned char ref;  /* CLOCK reference bit */
+};
+
+struct memo {
+	ffi_cif *cif;
+	void (*fn)(void);
+	size_t *offsets;  /* of the arguments in the key */
+	size_t keysize, stride;
+	uint32_t cap, count, hand;
+	size_t mask;  /* index size - 1 */
+	uint32_t *index;
+	char *entries;
+	lua_Integer hits, misses, evictions;
+};
+
+#define memo_entry_(m, i) ((struct memo_entry *) ((m)->entries + \
+	(size_t) (i) * (m)->stride))
+#define memo_value_(e) ((char *) (e) + memo_align_(sizeof (struct memo_entry)))
+#define memo_key_(m, e) (memo_value_(e) + \
+	memo_align_((m)->cif->rtype->size))
+
+/* Rounds off up to the alignment of the type */
+static
+size_t memo_offset_(size_t off, ffi_type *type)
+{
+	size_t a = type->alignment > 0 ? type->alignment : 1;
+
+	return (off + a - 1) / a * a;
+}
+
+/* Whether values of the type hold no pointers */
+static
+int memo_plain_(ffi_type *type)
+{
+	ffi_type **t;
+
+	switch (type->type) {
+	case FFI_TYPE_POINTER:
+	case FFI_TYPE_VOID:
+		return 0;
+	case FFI_TYPE_STRUCT:
+		for (t = type->elements; *t != NULL; t++) {
+			if (!memo_plain_(*t))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static
+uint32_t memo_hash_(const unsigned char *p, size_t n)
+{
+	uint32_t h = 2166136261u;  /* FNV-1a */
+
+	while (n-- > 0)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+/* Removes entry e from the index */
+static
+void memo_unindex_(struct memo *m, uint32_t e)
+{
+	size_t i = memo_entry_(m, e)->hash & m->mask, j, k;
+
+	while (m->index[i] != e + 1)
+		i = (i + 1) & m->mask;
+	/* shift back the entries that follow */
+	for (j = i;;) {
+		j = (j + 1) & m->mask;
+		if (m->index[j] == 0)
+			break;
+		k = memo_entry_(m, m->index[j] - 1)->hash & m->mask;
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			m->index[i] = m->index[j];
+			i = j;
+		}
+	}
+	m->index[i] = 0;
+}
+
+static
+struct memo *checkmemo_(lua_State *L, int idx)
+{
+	struct memo *m = (struct memo *) checkudata_(L, idx, memo_tag);
+
+	if (m->entries == NULL)
+		luaL_argerror(L, idx, "memo is released");
+	return m;
+}
+
+/* memo(args...) */
+static
+int memo_call(lua_State *L)
+{
+	struct memo *m = checkmemo_(L, 1);
+	ffi_cif *cif = m->cif;
+	ffi_type *rtype = cif->rtype;
+	unsigned nargs = cif->nargs, i;
+	unsigned char *key = (unsigned char *) alloca(m->keysize);
+	void **args = (void **) alloca(sizeof args[0] * (nargs + 1));
+	struct memo_entry *e;
+	uint32_t h, n;
+	size_t slot;
+	void *rvalue;
+
+	if ((unsigned) lua_gettop(L) - 1 != nargs)
+		return luaL_error(L, "expect %d arguments, got %d",
+			nargs, lua_gettop(L) - 1);
+	memset(key, 0, m->keysize);
+	for (i = 0; i < nargs; i++) {
+		args[i] = key + m->offsets[i];
+		cast2c(L, i+2, args[i], cif->arg_types[i]);
+	}
+	h = memo_hash_(key, m->keysize);
+	for (slot = h & m->mask; (n = m->index[slot]) != 0;
+			slot = (slot + 1) & m->mask) {
+		e = memo_entry_(m, n - 1);
+		if (e->hash == h &&
+				memcmp(memo_key_(m, e), key, m->keysize) == 0) {
+			m->hits++;
+			e->ref = 1;
+			rvalue = memo_value_(e);
+			goto push;
+		}
+	}
+	m->misses++;
+	if (m->count < m->cap) {
+		n = m->count++;
+	} else {
+		while (memo_entry_(m, m->hand)->ref) {
+			memo_entry_(m, m->hand)->ref = 0;
+			m->hand = (m->hand + 1) % m->cap;
+		}
+		n = m->hand;
+		m->hand = (m->hand + 1) % m->cap;
+		memo_unindex_(m, n);
+		m->evictions++;
+		for (slot = h & m->mask; m->index[slot] != 0;
+				slot = (slot + 1) & m->mask)
+			;
+	}
+	e = memo_entry_(m, n);
+	/* libffi may store a whole ffi_arg */
+	rvalue = (rtype->size < sizeof (ffi_arg)) ?
+		alloca(sizeof (ffi_arg)) : memo_value_(e);
+	if (tracing_()) {
+		struct trace_frame tf;
+
+		trace_enter_(&tf);
+		ffi_call(cif, m->fn, rvalue, args);
+		trace_leave_(&tf, TRACE_CALL, (void *) m->fn);
+	} else {
+		ffi_call(cif, m->fn, rvalue, args);
+	}
+	if (rvalue != memo_value_(e)) {
+		memcpy(memo_value_(e), rvalue, rtype->size);
+		rvalue = memo_value_(e);
+	}
+	memcpy(memo_key_(m, e), key, m->keysize);
+	e->hash = h;
+	e->ref = 0;
+	m->index[slot] = n + 1;
+push:
+	if (rtype->type != FFI_TYPE_STRUCT && rtype->type != FFI_TYPE_COMPLEX) {
+		cast2lua(L, rvalue, rtype);
+		return 1;
+	}
+	if (argflags_(cif)[nargs] & RET_UNPACK)
+		return unpack_(L, (char *) rvalue, rtype);
+	lua_getuservalue(L, 1);  /* the bound function */
+	lua_getupvalue(L, -1, 1);
+	lua_getuservalue(L, -1);
+	lua_getfield(L, -1, "ret");
+	memcpy(lua_newuserdata(L, rtype->size), rvalue, rtype->size);
+	initobj_(L, lua_gettop(L) - 1);
+	track_(L, MEM_RETURN);
+	return 1;
+}
+
+/* memo:stats() -> hits, misses, evictions, number of entries */
+static
+int memo_stats(lua_State *L)
+{
+	struct memo *m = checkmemo_(L, 1);
+
+	lua_pushinteger(L, m->hits);
+	lua_pushinteger(L, m->misses);
+	lua_pushinteger(L, m->evictions);
+	lua_pushinteger(L, m->count);
+	return 4;
+}
+
+/* memo:clear(); drops the entries and resets the counters */
+static
+int memo_clear(lua_State *L)
+{
+	struct memo *m = checkmemo_(L, 1);
+
+	memset(m->index, 0, sizeof m->index[0] * (m->mask + 1));
+	m->count = m->hand = 0;
+	m->hits = m->misses = m->evictions = 0;
+	return 0;
+}
+
+/* memo.__gc */
+static
+int memo_gc(lua_State *L)
+{
+	struct memo *m = (struct memo *) checkudata_(L, 1, memo_tag);
+
+	if (m->entries != NULL) {
+		external_(L, -(lua_Integer) (m->stride * m->cap +
+			sizeof m->index[0] * (m->mask + 1)));
+		free(m->entries);
+		free(m->index);
+		m->entries = NULL;
+		m->index = NULL;
+	}
+	return 0;
+}
+
+/* memo.__tostring */
+static
+int memo_tostr(lua_State *L)
+{
+	struct memo *m = (struct memo *) checkudata_(L, 1, memo_tag);
+
+	lua_pushfstring(L, "ffi_memo: %p (%d/%d)", m, (int) m->count,
+		(int) m->cap);
+	return 1;
+}
+
+/* Memoizes a bound function.
+ *
+ * Arg 1: a function made by loadlib or bind, of a cif whose arguments and
+ *        return value are scalars or structs without pointers.
+ * Arg 2: (optional) {capacity = n}, the number of results kept
+ *        (default: 256).
+ * Returns the memo, which is called like the function.
+ */
+static
+int memoize(lua_State *L)
+{
+	lua_Integer cap = 256;
+	struct memo *m;
+	ffi_cif *cif;
+	size_t size, off;
+	unsigned i;
+
+	luaL_argcheck(L, lua_tocfunction(L, 1) == funccall, 1,
+		"expect an ffi function");
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "capacity");
+		cap = luaL_optinteger(L, -1, cap);
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, 0 < cap && cap <= 0x10000000, 2, "invalid capacity");
+	lua_settop(L, 1);
+	lua_getupvalue(L, 1, 1);  /* 2: cif */
+	cif = tocif_(L, 2);
+	luaL_argcheck(L, memo_plain_(cif->rtype), 1,
+		"return value must be a scalar or a plain struct");
+	luaL_argcheck(L, (argflags_(cif)[cif->nargs] & ~RET_UNPACK) == 0, 1,
+		"special arguments are not supported");
+	for (i = 0, off = 0; i < cif->nargs; i++) {
+		ffi_type *t = cif->arg_types[i];
+
+		luaL_argcheck(L, memo_plain_(t), 1,
+			"arguments must be scalars or plain structs");
+		off = memo_offset_(off, t);
+		off += t->size;
+	}
+	m = (struct memo *) lua_newuserdata(L, sizeof *m +
+		sizeof m->offsets[0] * cif->nargs);
+	memset(m, 0, sizeof *m);
+	setmetatable_(L, memo_tag);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	m->cif = cif;
+	lua_getupvalue(L, 1, 2);
+	m->fn = tofn_(L, -1);
+	lua_pop(L, 1);
+	m->offsets = (size_t *) (m + 1);
+	for (i = 0, off = 0; i < cif->nargs; i++) {
+		ffi_type *t = cif->arg_types[i];
+
+		off = memo_offset_(off, t);
+		m->offsets[i] = off;
+		off += t->size;
+	}
+	m->keysize = off > 0 ? off : 1;
+	m->stride = memo_align_(sizeof (struct memo_entry)) +
+		memo_align_(cif->rtype->size) + memo_align_(m->keysize);
+	m->cap = (uint32_t) cap;
+	for (size = 1; size < (size_t) cap * 2; size <<= 1)
+		;
+	m->mask = size - 1;
+	m->index = (uint32_t *) calloc(size, sizeof m->index[0]);
+	m->entries = (char *) malloc(m->stride * m->cap);
+	if (m->index == NULL || m->entries == NULL) {
+		free(m->index);
+		free(m->entries);
+		m->index = NULL;
+		m->entries = NULL;
+		return luaL_error(L, "not enough memory");
+	}
+	external_(L, m->stride * m->cap + sizeof m->index[0] * size);
+	return 1;
+}
+
+/* Loads a library.
+ *
+ * Arg 1: path to the shared library.
+ * Arg 2: a table.  Any element in this table of type ffi_cif will be converted
+ *        into a function that calls the function named as the key.
+ * Returns the table.
+ */
+static
+int loadlib(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TSTRING);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	luaL_requiref(L, "package", luaopen_package, 0);
+	lua_getfield(L, -1, "loadlib");
+	if (!lua_isfunction(L, -1)) {
+		return luaL_error(L, "cannot find package.loadlib");
+	}
+	lua_replace(L, -2);  /* 3: package.loadlib */
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		/* 4: key;  5: value */
+		if (lua_type(L, 4) != LUA_TSTRING ||
+				!testudata_(L, 5, cif_tag)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_pushvalue(L, 3);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 4);
+		lua_call(L, 2, LUA_MULTRET);  /* package.loadlib(libname, key) */
+		/* 4:name 5:cif 6:(cfunc|true|nil 7:err1 err2) */
+		if (lua_isnil(L, 6)) {
+			lua_settop(L, 7);
+			return lua_error(L);
+		}
+		if (!lua_iscfunction(L, 6)) {
+			return luaL_error(L, "cannot load '%s'",
+				lua_tostring(L, 4));
+		}
+		pushfunc_(L);
+		/* 4:name 5:func */
+		lua_pushvalue(L, 4);
+		lua_insert(L, 5);
+		lua_rawset(L, 2);
+		/* 4:name */
+	}
+	lua_settop(L, 2);
+	return 1;
+}
+
+
+/** FFI closure
+ *
+ * Provides a callback to the foreign function.
+ *
+ * When the closure is made, each argument type is resolved to a function
+ * that pushes it, and the return type to one that stores it, so a call
+ * does no type dispatch of its own.
+ */
+
+/* Pushes arguments of a known type */
+#define PUSH_INT(tag, c_type, name) \
+static void pushint_##name(lua_State *L, void *addr, ffi_type *type) \
+{ \
+	lua_pushinteger(L, (lua_Integer) *(c_type *) addr); \
+}
+#define PUSH_NUM(tag, c_type, name) \
+static void pushnum_##name(lua_State *L, void *addr, ffi_type *type) \
+{ \
+	lua_pushnumber(L, (lua_Number) *(c_type *) addr); \
+}
+INT_TYPE_LIST_(PUSH_INT)
+FLOAT_TYPE_LIST_(PUSH_NUM)
+#undef PUSH_INT
+#undef PUSH_NUM
+
+static
+void pushptr_arg_(lua_State *L, void *addr, ffi_type *type)
+{
+	void *p = *(void **) addr;
+
+	(p == NULL) ? lua_pushnil(L) : lua_pushlightuserdata(L, p);
+}
+
+/* Any other type */
+static
+void pushany_arg_(lua_State *L, void *addr, ffi_type *type)
+{
+	cast2lua(L, addr, type);
+}
+
+static
+push_fn argpush_fn_(ffi_type *type)
+{
+	switch (type->type) {
+#define CASE(ffi_type, c_type, name) case ffi_type: return pushint_##name;
+	INT_TYPE_LIST_(CASE)
+#undef CASE
+#define CASE(ffi_type, c_type, name) case ffi_type: return pushnum_##name;
+	FLOAT_TYPE_LIST_(CASE)
+#undef CASE
+	case FFI_TYPE_POINTER:
+		return pushptr_arg_;
+	}
+	return pushany_arg_;
+}
+
+/* Stores the value at stack top as a return value of a known type.  Only
+ * numbers of the matching kind are converted here; other values, which
+ * cast2c may convert or reject, are left to it.  libFFI expects integers
+ * narrower than ffi_arg to be widened to ffi_arg either way.
+ */
+#define STORE_INT(tag, c_type, name) \
+static void storeint_##name(lua_State *L, void *ret, ffi_type *type) \
+{ \
+	c_type v; \
+\
+	if (lua_isinteger(L, -1)) \
+		v = (c_type) lua_tointeger(L, -1); \
+	else \
+		cast2c(L, -1, &v, type); \
+	if (sizeof (c_type) < sizeof (ffi_arg)) \
+		*(ffi_arg *) ret = (ffi_arg) v; \
+	else \
+		*(c_type *) ret = v; \
+}
+#define STORE_NUM(tag, c_type, name) \
+static void storenum_##name(lua_State *L, void *ret, ffi_type *type) \
+{ \
+	if (lua_type(L, -1) == LUA_TNUMBER) \
+		*(c_type *) ret = (c_type) lua_tonumber(L, -1); \
+	else \
+		cast2c(L, -1, ret, type); \
+}
+INT_TYPE_LIST_(STORE_INT)
+FLOAT_TYPE_LIST_(STORE_NUM)
+#undef STORE_INT
+#undef STORE_NUM
+
+static
+void storeany_ret_(lua_State *L, void *ret, ffi_type *type)
+{
+	cast2c(L, -1, ret, type);
+}
+
+static
+void (*rstore_fn_(ffi_type *type))(lua_State *, void *, ffi_type *)
+{
+	switch (type->type) {
+	case FFI_TYPE_VOID:
+		return NULL;
+#define CASE(ffi_type, c_type, name) case ffi_type: return storeint_##name;
+	INT_TYPE_LIST_(CASE)
+#undef CASE
+#define CASE(ffi_type, c_type, name) case ffi_type: return storenum_##name;
+	FLOAT_TYPE_LIST_(CASE)
+#undef CASE
+	}
+	return storeany_ret_;
+}
+
+/* Pushes the argument views of a call, one for each argument passed as a
+ * view.  The views are made for each call, since the function may keep
+ * them: a view reused by the next call would alias its memory.
+ */
+static
+void push_argviews_(lua_State *L, struct closure *cl, unsigned nargs)
+{
+	size_t *viewsizes = viewsizes_(cl);
+	int types;
+	unsigned i;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cl->views_ref);
+	types = lua_gettop(L);
+	for (i = 0; i < nargs; i++) {
+		if (viewsizes[i] == 0)
+			continue;
+		lua_rawgeti(L, types, i+1);
+		newview_(L, NULL, 0, -1);
+		lua_replace(L, -2);
+	}
+	lua_remove(L, types);
+}
+
+/* Calls the closure with views for struct and ptr(T) arguments.  The
+ * views are invalidated after the call, even if it raises an error, so
+ * that a view kept by the function raises an error when used.
+ */
+static
+void closureproxy_views_(lua_State *L, struct closure *cl, ffi_cif *cif,
+	void *ret, void **args)
+{
+	size_t *viewsizes = viewsizes_(cl);
+	unsigned nargs = cif->nargs;
+	ffi_type *rtype = cif->rtype;
+	int base = lua_gettop(L), top, status, idx;
+	unsigned i;
+
+	luaL_checkstack(L, 2 * nargs + 4, NULL);
+	push_argviews_(L, cl, nargs);
+	top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cl->fn_ref);
+	idx = base + 1;
+	for (i = 0; i < nargs; i++) {
+		struct view *v;
+		void *p;
+
+		if (viewsizes[i] == 0) {
+			argpush_(cl)[i](L, args[i], cif->arg_types[i]);
+			continue;
+		}
+		v = (struct view *) lua_touserdata(L, idx);
+		p = (argflags_(cif)[i] & ARG_VIEW) ? *(void **) args[i] : args[i];
+		if (p == NULL) {
+			lua_pushnil(L);
+		} else {
+			v->ptr = (char *) p;
+			v->size = viewsizes[i];
+			lua_pushvalue(L, idx);
+		}
+		idx++;
+	}
+	status = lua_pcall(L, nargs, rtype->type != FFI_TYPE_VOID, 0);
+	for (idx = base + 1; idx <= top; idx++) {
+		struct view *v = (struct view *) lua_touserdata(L, idx);
+
+		v->ptr = NULL;
+		v->size = 0;
+	}
+	if (status != LUA_OK) {
+		lua_error(L);
+	}
+	if (cl->rstore != NULL) {
+		cl->rstore(L, ret, rtype);
+	}
+	lua_settop(L, base);
+}
+
+/* The entry point of the closure.  This function reads closure info
+ * from user_data, converts the arguments and calls the coresponding function.
+ */
+static
+void closureproxy_(ffi_cif *cif, void *ret, void **args, void *user_data)
+{
+	struct closure *cl = (struct closure *) user_data;
+	lua_State *L = cl->L;
+	unsigned nargs = cif->nargs;
+	unsigned i;
+	ffi_type *rtype = cif->rtype;
+	push_fn *argpush = argpush_(cl);
+
+	if (cl->views_ref != LUA_NOREF) {
+		closureproxy_views_(L, cl, cif, ret, args);
+		return;
+	}
+	luaL_checkstack(L, nargs + 3, NULL);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, cl->fn_ref);
+	/* push arguments */
+	for (i = 0; i < nargs; i++) {
+		argpush[i](L, args[i], cif->arg_types[i]);
+	}
+	if (cl->rstore != NULL) {
+		lua_call(L, nargs, 1);
+		cl->rstore(L, ret, rtype);
+		lua_pop(L, 1); /* pop return value from lua stack */
+	} else {
+		lua_call(L, nargs, 0);
+	}
+}
+
+/* closureproxy_ with tracing */
+static
+void closureproxy(ffi_cif *cif, void *ret, void **args, void *user_data)
+{
+	struct closure *cl = (struct closure *) user_data;
+	struct trace_frame tf;
+
+	if (!tracing_()) {
+		closureproxy_(cif, ret, args, user_data);
+		return;
+	}
+	trace_enter_(&tf);
+	closureproxy_(cif, ret, args, user_data);
+	trace_leave_(&tf, TRACE_CALLBACK, cl->exec_addr);
+}
+
+#if defined(FFI_JIT_X64)
+/* Callback thunks for x86-64 SysV
+ *
+ * For a closure whose arguments are integers, pointers, floats or doubles,
+ * all passed in registers, and whose result is void or one of those, a
+ * thunk is emitted that bypasses libFFI's closure path.  It spills the
+ * argument registers to its frame, pushes each argument with a direct call
+ * (lua_pushinteger after a sign or zero extension of the right width,
+ * lua_pushnumber, or pushptr_arg_), calls the function and stores the result
+ * with cl->rstore, as closureproxy_ does.  While tracing is on, the thunk
+ * jumps to libFFI's trampoline instead, so that the callback is traced.
+ * Errors are raised by longjmp through the thunk, so Lua must be built
+ * as C.  Each thunk has a page of its own, written, then made executable.
+ */
+
+#define JIT_SIZE 4096
+
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9 };
+
+struct jit {
+	unsigned char *code;
+	size_t n;
+};
+
+static
+void jit_emit_(struct jit *j, const char *bytes, size_t n)
+{
+	if (j->n + n <= JIT_SIZE)
+		memcpy(j->code + j->n, bytes, n);
+	j->n += n;
+}
+
+#define JIT_EMIT(j, bytes) jit_emit_(j, bytes, sizeof bytes - 1)
+
+static
+void jit_imm_(struct jit *j, uint64_t v, size_t n)
+{
+	char b[8];
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		b[i] = (char) (v >> (8 * i));
+	jit_emit_(j, b, n);
+}
+
+/* mov reg, imm64 */
+static
+void jit_movabs_(struct jit *j, int reg, uint64_t v)
+{
+	char op[2] = {0x48, (char) (0xb8 + reg)};
+
+	jit_emit_(j, op, 2);
+	jit_imm_(j, v, 8);
+}
+
+/* op reg, [rbp + disp] with a 32-bit displacement; op is emitted as is,
+ * and a register from r8 sets REX.R in its REX prefix (the first byte) */
+static
+void jit_rbp_(struct jit *j, const char *op, size_t n, int reg, int32_t disp)
+{
+	char b[8], modrm = (char) (0x85 | (reg & 7) << 3);
+
+	memcpy(b, op, n);
+	if (reg >= 8)
+		b[0] |= 0x04;
+	jit_emit_(j, b, n);
+	jit_emit_(j, &modrm, 1);
+	jit_imm_(j, (uint32_t) disp, 4);
+}
+
+static
+void jit_call_(struct jit *j, void (*fn)(void))
+{
+	jit_movabs_(j, RAX, (uint64_t) (uintptr_t) fn);
+	JIT_EMIT(j, "\xff\xd0");  /* call rax */
+}
+
+/* Returns a thunk for the closure, or NULL to keep libFFI's trampoline */
+static
+void *jit_compile_(struct closure *cl, ffi_cif *cif)
+{
+	static const int gprs[] = {RDI, RSI, RDX, RCX, R8, R9};
+	unsigned nargs = cif->nargs, ngpr = 0, nfpr = 0, i;
+	ffi_type *rtype = cif->rtype;
+	uint64_t L = (uint64_t) (uintptr_t) cl->L;
+	int32_t frame, retslot;
+	struct jit j;
+
+	if (cif->abi != FFI_DEFAULT_ABI || cl->views_ref != LUA_NOREF ||
+			sizeof (lua_Number) != sizeof (double) ||
+			sizeof (lua_Integer) != sizeof (int64_t))
+		return NULL;
+	for (i = 0; i < nargs; i++) {
+		switch (cif->arg_types[i]->type) {
+#define CASE(ffi_type, ...) case ffi_type:
+		INT_TYPE_LIST_(CASE)
+#undef CASE
+		case FFI_TYPE_POINTER:
+			if (ngpr++ == 6)
+				return NULL;
+			break;
+		case FFI_TYPE_FLOAT:
+		case FFI_TYPE_DOUBLE:
+			if (nfpr++ == 8)
+				return NULL;
+			break;
+		default:
+			return NULL;
+		}
+	}
+	switch (rtype->type) {
+#define CASE(ffi_type, ...) case ffi_type:
+	INT_TYPE_LIST_(CASE)
+#undef CASE
+	case FFI_TYPE_VOID:
+	case FFI_TYPE_POINTER:
+	case FFI_TYPE_FLOAT:
+	case FFI_TYPE_DOUBLE:
+		break;
+	default:
+		return NULL;
+	}
+	j.code = (unsigned char *) mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j.code == MAP_FAILED)
+		return NULL;
+	j.n = 0;
+	/* a slot for each argument and one for the result, rsp kept aligned */
+	retslot = -8 * (int32_t) (nargs + 1);
+	frame = (-retslot + 15) & ~15;
+
+	/* while tracing, take libFFI's path */
+	jit_movabs_(&j, RAX, (uint64_t) (uintptr_t) &trace_on);
+	JIT_EMIT(&j, "\x8b\x00\x85\xc0\x74\x0c");  /* test [rax]; jz +12 */
+	jit_movabs_(&j, RAX, (uint64_t) (uintptr_t) cl->exec_addr);
+	JIT_EMIT(&j, "\xff\xe0");  /* jmp rax */
+
+	JIT_EMIT(&j, "\x55\x48\x89\xe5\x48\x81\xec");  /* push rbp... */
+	jit_imm_(&j, (uint32_t) frame, 4);  /* ...sub rsp, frame */
+	ngpr = nfpr = 0;
+	for (i = 0; i < nargs; i++) {
+		int32_t slot = -8 * (int32_t) (i + 1);
+		int t = cif->arg_types[i]->type;
+
+		if (t == FFI_TYPE_FLOAT || t == FFI_TYPE_DOUBLE)
+			jit_rbp_(&j, "\xf2\x0f\x11", 3, nfpr++, slot);  /* movsd */
+		else
+			jit_rbp_(&j, "\x48\x89", 2, gprs[ngpr++], slot);  /* mov */
+	}
+	jit_movabs_(&j, RDI, L);
+	JIT_EMIT(&j, "\xbe");  /* mov esi, nargs + 3 */
+	jit_imm_(&j, nargs + 3, 4);
+	JIT_EMIT(&j, "\x31\xd2");  /* xor edx, edx */
+	jit_call_(&j, (void (*)(void)) luaL_checkstack);
+	jit_movabs_(&j, RDI, L);
+	JIT_EMIT(&j, "\xbe");  /* mov esi, LUA_REGISTRYINDEX */
+	jit_imm_(&j, (uint32_t) LUA_REGISTRYINDEX, 4);
+	jit_movabs_(&j, RDX, (uint64_t) (int64_t) cl->fn_ref);
+	jit_call_(&j, (void (*)(void)) lua_rawgeti);
+	for (i = 0; i < nargs; i++) {
+		int32_t slot = -8 * (int32_t) (i + 1);
+
+		jit_movabs_(&j, RDI, L);
+		switch (cif->arg_types[i]->type) {
+#define LOAD(ffi_type, op) case ffi_type: \
+			jit_rbp_(&j, op, sizeof op - 1, RSI, slot); \
+			jit_call_(&j, (void (*)(void)) lua_pushinteger); \
+			break;
+		LOAD(FFI_TYPE_SINT8, "\x48\x0f\xbe")  /* movsx rsi, byte */
+		LOAD(FFI_TYPE_UINT8, "\x0f\xb6")  /* movzx esi, byte */
+		LOAD(FFI_TYPE_SINT16, "\x48\x0f\xbf")  /* movsx rsi, word */
+		LOAD(FFI_TYPE_UINT16, "\x0f\xb7")  /* movzx esi, word */
+		LOAD(FFI_TYPE_SINT32, "\x48\x63")  /* movsxd rsi, dword */
+		LOAD(FFI_TYPE_UINT32, "\x8b")  /* mov esi, dword */
+		LOAD(FFI_TYPE_SINT64, "\x48\x8b")  /* mov rsi, qword */
+		LOAD(FFI_TYPE_UINT64, "\x48\x8b")
+#undef LOAD
+		case FFI_TYPE_FLOAT:
+			jit_rbp_(&j, "\xf3\x0f\x5a", 3, 0, slot);  /* cvtss2sd */
+			jit_call_(&j, (void (*)(void)) lua_pushnumber);
+			break;
+		case FFI_TYPE_DOUBLE:
+			jit_rbp_(&j, "\xf2\x0f\x10", 3, 0, slot);  /* movsd */
+			jit_call_(&j, (void (*)(void)) lua_pushnumber);
+			break;
+		default:
+			jit_rbp_(&j, "\x48\x8d", 2, RSI, slot);  /* lea */
+			jit_call_(&j, (void (*)(void)) pushptr_arg_);
+		}
+	}
+	jit_movabs_(&j, RDI, L);
+	JIT_EMIT(&j, "\xbe");  /* mov esi, nargs */
+	jit_imm_(&j, nargs, 4);
+	JIT_EMIT(&j, "\xba");  /* mov edx, nresults */
+	jit_imm_(&j, cl->rstore != NULL, 4);
+	JIT_EMIT(&j, "\x31\xc9\x45\x31\xc0");  /* xor ecx, ecx; xor r8d, r8d */
+	jit_call_(&j, (void (*)(void)) lua_callk);
+	if (cl->rstore != NULL) {
+		jit_movabs_(&j, RDI, L);
+		jit_rbp_(&j, "\x48\x8d", 2, RSI, retslot);  /* lea */
+		jit_movabs_(&j, RDX, (uint64_t) (uintptr_t) rtype);
+		jit_call_(&j, (void (*)(void)) cl->rstore);
+		jit_movabs_(&j, RDI, L);
+		JIT_EMIT(&j, "\xbe\xfe\xff\xff\xff");  /* mov esi, -2 */
+		jit_call_(&j, (void (*)(void)) lua_settop);
+		if (rtype->type == FFI_TYPE_FLOAT)  /* movss xmm0 */
+			jit_rbp_(&j, "\xf3\x0f\x10", 3, 0, retslot);
+		else if (rtype->type == FFI_TYPE_DOUBLE)  /* movsd xmm0 */
+			jit_rbp_(&j, "\xf2\x0f\x10", 3, 0, retslot);
+		else  /* mov rax */
+			jit_rbp_(&j, "\x48\x8b", 2, RAX, retslot);
+	}
+	JIT_EMIT(&j, "\xc9\xc3");  /* leave; ret */
+
+	if (j.n > JIT_SIZE ||
+			mprotect(j.code, JIT_SIZE, PROT_READ | PROT_EXEC) != 0) {
+		munmap(j.code, JIT_SIZE);
+		return NULL;
+	}
+	return j.code;
+}
+#endif
+
+/* Collects the types of the views for struct and ptr(T) arguments of the
+ * closure at stack top, whose cif is at cif_idx.
+ */
+static
+void init_argviews_(lua_State *L, struct closure *cl, int cif_idx)
+{
+	ffi_cif *cif = tocif_(L, cif_idx);
+	unsigned char *argflags = argflags_(cif);
+	size_t *viewsizes = viewsizes_(cl);
+	unsigned i, nviews = 0;
+
+	lua_getuservalue(L, cif_idx);
+	lua_createtable(L, cif->nargs, 0);
+	for (i = 0; i < cif->nargs; i++) {
+		struct ptrarg *pa;
+
+		viewsizes[i] = 0;
+		lua_rawgeti(L, -2, i+1);
+		if (argflags[i] & ARG_VIEW) {
+			pa = (struct ptrarg *) lua_touserdata(L, -1);
+			viewsizes[i] = pa->type->size * pa->count;
+			lua_getuservalue(L, -1);
+			lua_replace(L, -2);
+		} else if (cif->arg_types[i]->type == FFI_TYPE_STRUCT) {
+			viewsizes[i] = cif->arg_types[i]->size;
+		}
+		if (viewsizes[i] != 0) {
+			lua_rawseti(L, -2, i+1);
+			nviews++;
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	if (nviews > 0) {
+		cl->views_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/* Creates a FFI closure from a function.
+ *
+ * Struct arguments and ptr(T) arguments are passed to the function as
+ * views of the native memory, valid only during the call.
+ */
+static
+int makeclosure(lua_State *L)
+{
+	struct closure *cl;
+	ffi_status status;
+	ffi_cif *cif;
+	unsigned i;
+
+	cif = (ffi_cif *) checkudata_(L, 1, cif_tag);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	cl = (struct closure *) lua_newuserdata(L, sizeof *cl +
+		(sizeof (size_t) + sizeof (push_fn)) * cif->nargs);
+	cl->closure = NULL;
+	cl->jit = NULL;
+	cl->fn_ref = LUA_NOREF;
+	cl->views_ref = LUA_NOREF;
+	cl->nargs = cif->nargs;
+	cl->rstore = rstore_fn_(cif->rtype);
+	for (i = 0; i < cif->nargs; i++) {
+		argpush_(cl)[i] = argpush_fn_(cif->arg_types[i]);
+	}
+	setmetatable_(L, closure_tag);
+	lua_pushvalue(L, 1);
+	lua_setuservalue(L, -2);
+	cl->L = L;
+	init_argviews_(L, cl, 1);
+	lua_pushvalue(L, 2);
+	cl->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	cl->closure = (ffi_closure *) ffi_closure_alloc(sizeof *cl->closure,
+		&cl->exec_addr);
+	if (cl->closure == NULL) {
+		return luaL_error(L, "cannot allocate closure");
+	}
+	memstats_(L)->cat[MEM_CLOSURE].count++;
+	memstats_(L)->cat[MEM_CLOSURE].bytes += sizeof *cl + sizeof *cl->closure;
+	external_(L, sizeof *cl->closure);
+	status = ffi_prep_closure_loc(cl->closure, cif, closureproxy, cl,
+		cl->exec_addr);
+	if (status != FFI_OK) {
+		return luaL_error(L, "failed to prepare closure");
+	}
+#if defined(FFI_JIT_X64)
+	if ((cl->jit = jit_compile_(cl, cif)) != NULL) {
+		cl->exec_addr = cl->jit;
+		memstats_(L)->cat[MEM_CLOSURE].bytes += JIT_SIZE;
+		external_(L, JIT_SIZE);
+	}
+#endif
+	return 1;
+}
+
+/* closure.__gc */
+static
+int closuregc(lua_State *L)
+{
+	struct closure *cl = (struct closure *) checkudata_(L, 1, closure_tag);
+
+#if defined(FFI_JIT_X64)
+	if (cl->jit != NULL) {
+		munmap(cl->jit, JIT_SIZE);
+		cl->jit = NULL;
+		memstats_(L)->cat[MEM_CLOSURE].bytes -= JIT_SIZE;
+		external_(L, -(lua_Integer) JIT_SIZE);
+	}
+#endif
+	if (cl->closure) {
+		ffi_closure_free(cl->closure);
+		cl->closure = NULL;
+		memstats_(L)->cat[MEM_CLOSURE].count--;
+		memstats_(L)->cat[MEM_CLOSURE].bytes -=
+			sizeof *cl + sizeof *cl->closure;
+		external_(L, -(lua_Integer) sizeof *cl->closure);
+	}
+	if (cl->fn_ref != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, cl->fn_ref);
+		cl->fn_ref = LUA_NOREF;
+	}
+	if (cl->views_ref != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, cl->views_ref);
+		cl->views_ref = LUA_NOREF;
+	}
+	return 0;
+}
+
+/* closure.__tostring */
+static
+int closure_tostr(lua_State *L)
+{
+	struct closure *cl;
+	ffi_cif *cif;
+	luaL_Buffer B;
+
+	cl = (struct closure *) checkudata_(L, 1, closure_tag);
+
+	luaL_buffinit(L, &B);
+	lua_pushfstring(L, "ffi_closure %p <", cl);
+	luaL_addvalue(&B);
+	lua_getuservalue(L, 1);
+	cif = checkudata_(L, -1, cif_tag);
+	add_cif(&B, cif);
+	luaL_addchar(&B, '>');
+	luaL_pushresult(&B);
+	return 1;
+}
+
+
+/** Record streams
+ *
+ * A stream reads or writes a file as a sequence of fixed-size records of
+ * one ffi_type.  The userdata is a struct stream with metatable "ffi_stream",
+ * and its uservalue is a table {T, view1, view2}, where view1 and view2 are
+ * the two chunk buffers of a reader.
+ */
+
+struct stream {
+	FILE *fp;  /* closed in __gc */
+	size_t size;  /* size of a record */
+	size_t chunk;  /* number of records per read */
+	size_t tail;  /* bytes of a partial record at end of file */
+	int cur;  /* the view to fill next (0 or 1) */
+	int writable;
+};
+
+#define STREAM_CHUNK_BYTES 65536
+
+#if defined(POSIX_FADV_WILLNEED)
+# define POSIX_FADV_WILLNEED_ POSIX_FADV_WILLNEED
+#else
+# define POSIX_FADV_WILLNEED_ 0
+#endif
+
+/* Hints the kernel to read ahead, so that the next chunk is being read
+ * while Lua processes the current one. */
+static
+void stream_advise_(struct stream *s, int advice)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+	off_t pos = ftello(s->fp);
+
+	if (pos >= 0) {
+		posix_fadvise(fileno(s->fp), pos, s->size * s->chunk, advice);
+	}
+#else
+	(void) s; (void) advice;
+#endif
+}
+
+static
+struct stream *newstream_(lua_State *L, const char *path, const char *mode)
+{
+	struct stream *s = (struct stream *) lua_newuserdata(L, sizeof *s);
+
+	s->fp = NULL;
+	setmetatable_(L, stream_tag);
+	s->fp = fopen(path, mode);
+	return s;
+}
+
+/* Opens a file for reading records.
+ *
+ * Arg 1: path.
+ * Arg 2: type of the records.
+ * Arg 3: number of records per chunk (default: as many as fit in 64KiB).
+ * Returns a stream.  Calling the stream (or stream:read()) returns a chunk
+ * view and the number of records in it, or nothing at end of file, so that
+ *
+ * 	for buf, n in ffi.reader(path, T) do ... end
+ *
+ * iterates over the file.  The two chunk views are reused alternately, so a
+ * view remains valid until the second read after the one that returned it.
+ * A partial record at the end of the file is an error, raised by the read
+ * after the one that returned the last whole records.
+ */
+static
+int reader(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	ffi_type *type = (ffi_type *) checkudata_(L, 2, type_tag);
+	lua_Integer chunk;
+	struct stream *s;
+	int i;
+
+	luaL_argcheck(L, type->size > 0, 2, "type has no size");
+	chunk = luaL_optinteger(L, 3, STREAM_CHUNK_BYTES / type->size);
+	if (chunk <= 0)
+		chunk = 1;
+	luaL_argcheck(L, (lua_Unsigned) chunk <= SIZE_MAX / type->size, 3,
+		"chunk too large");
+	s = newstream_(L, path, "rb");
+	if (s->fp == NULL)
+		return luaL_fileresult(L, 0, path);
+	s->size = type->size;
+	s->chunk = chunk;
+	s->tail = 0;
+	s->cur = 0;
+	s->writable = 0;
+	/* records go straight from read() into the views */
+	setvbuf(s->fp, NULL, _IONBF, 0);
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fileno(s->fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	stream_advise_(s, POSIX_FADV_WILLNEED_);
+	lua_createtable(L, 3, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	for (i = 0; i < 2; i++) {
+		lua_newuserdata(L, s->size * s->chunk);
+		initobj_(L, 2);
+		track_(L, MEM_OTHER);
+		lua_rawseti(L, -2, i+2);
+	}
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+/* Opens a file for writing records.
+ *
+ * Arg 1: path.
+ * Arg 2: type of the records.
+ * Arg 3: (optional) "a" to append instead of truncating the file.
+ * Returns a stream, whose write method accepts objects or arrays of the type.
+ */
+static
+int writer(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	ffi_type *type = (ffi_type *) checkudata_(L, 2, type_tag);
+	const char *mode = luaL_optstring(L, 3, "w");
+	struct stream *s;
+
+	luaL_argcheck(L, type->size > 0, 2, "type has no size");
+	luaL_argcheck(L, mode[0] == 'w' || mode[0] == 'a', 3, "invalid mode");
+	s = newstream_(L, path, (mode[0] == 'a') ? "ab" : "wb");
+	if (s->fp == NULL)
+		return luaL_fileresult(L, 0, path);
+	s->size = type->size;
+	s->chunk = 0;
+	s->tail = 0;
+	s->cur = 0;
+	s->writable = 1;
+	/* coalesces small writes of single records */
+	setvbuf(s->fp, NULL, _IOFBF, STREAM_CHUNK_BYTES);
+	external_(L, STREAM_CHUNK_BYTES);
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1);
+	lua_setuservalue(L, -2);
+	return 1;
+}
+
+static
+struct stream *checkstream_(lua_State *L, int writable)
+{
+	struct stream *s = (struct stream *) checkudata_(L, 1, stream_tag);
+
+	if (s->fp == NULL)
+		luaL_error(L, "attempt to use a closed stream");
+	if (s->writable != writable)
+		luaL_error(L, "stream is not %s", writable ? "writable" : "readable");
+	return s;
+}
+
+/* stream:read() -> view n | nothing */
+static
+int stream_read(lua_State *L)
+{
+	struct stream *s = (struct stream *) checkudata_(L, 1, stream_tag);
+	size_t n;
+	int err;
+
+	if (s->fp == NULL)
+		return 0;  /* ends a for loop */
+	checkstream_(L, 0);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, s->cur + 2);
+	/* fread only comes up short at end of file or on error, so a
+	 * remainder is the tail of the file */
+	n = (s->tail != 0) ? 0 :
+		fread(lua_touserdata(L, -1), 1, s->size * s->chunk, s->fp);
+	if (n % s->size != 0) {
+		s->tail = n % s->size;
+		n -= s->tail;
+	}
+	if (n == 0) {
+		err = ferror(s->fp);
+		fclose(s->fp);
+		s->fp = NULL;
+		if (err)
+			return luaL_error(L, "read error");
+		if (s->tail != 0)
+			return luaL_error(L, "partial record of %d bytes at end of file",
+				(int) s->tail);
+		return 0;
+	}
+	n /= s->size;
+	s->cur ^= 1;
+	stream_advise_(s, POSIX_FADV_WILLNEED_);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+/* stream:write(obj [, n]) -> stream
+ *
+ * Writes the first n records (default: all) of obj, which must be an
+ * ffi_obj of the stream's type.
+ */
+static
+int stream_write(lua_State *L)
+{
+	struct stream *s = checkstream_(L, 1);
+	size_t len;
+	void *obj = checkobj_(L, 2, &len);
+	lua_Integer n = luaL_optinteger(L, 3, len /= s->size);
+
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 1);
+	lua_getuservalue(L, 2);
+	luaL_argcheck(L, lua_rawequal(L, -1, -2), 2, "type mismatch");
+	luaL_argcheck(L, 0 <= n && (size_t) n <= len, 3, "count out of bound");
+	if (fwrite(obj, s->size, n, s->fp) != (size_t) n)
+		return luaL_fileresult(L, 0, NULL);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* stream:flush() -> stream */
+static
+int stream_flush(lua_State *L)
+{
+	struct stream *s = checkstream_(L, 1);
+
+	if (fflush(s->fp) != 0)
+		return luaL_fileresult(L, 0, NULL);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* stream:close(), stream.__gc */
+static
+int stream_close(lua_State *L)
+{
+	struct stream *s = (struct stream *) checkudata_(L, 1, stream_tag);
+	int rc = 0;
+
+	if (s->fp != NULL) {
+		rc = fclose(s->fp);
+		s->fp = NULL;
+		if (s->writable)
+			external_(L, -STREAM_CHUNK_BYTES);
+	}
+	return luaL_fileresult(L, rc == 0, NULL);
+}
+
+/* stream.__tostring */
+static
+int stream_tostr(lua_State *L)
+{
+	struct stream *s = (struct stream *) checkudata_(L, 1, stream_tag);
+	luaL_Buffer B;
+
+	luaL_buffinit(L, &B);
+	lua_pushfstring(L, "ffi_stream: %p <%s ", s,
+		(s->fp == NULL) ? "closed" :
+		(s->writable) ? "writer" : "reader");
+	luaL_addvalue(&B);
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, 1);
+	add_type(&B, (ffi_type *) lua_touserdata(L, -1));
+	lua_pop(L, 2);
+	luaL_addchar(&B, '>');
+	luaL_pushresult(&B);
+	return 1;
+}
+
+
+/** Codecs
+ *
+ * A codec converts between struct objects and plain Lua tables in one pass.
+ * The fields of the struct, including those of nested structs, are flattened
+ * in preorder into the array of struct codec_field, so each conversion is a
+ * loop over precomputed offsets and types.  The uservalue of the codec is a
+ * table whose array part holds the keys of the fields (the field name, or
+ * its index if it has no name) and field "type" the struct type.
+ */
+
+struct codec_field {
+	size_t offset;  /* from the start of the outermost struct */
+	ffi_type *type;
+	unsigned span;  /* number of nested fields that follow */
+};
+
+struct codec {
+	ffi_type *type;
+	unsigned nfields;
+	struct codec_field fields[1];
+};
+
+static
+unsigned codec_count_(ffi_type *type)
+{
+	unsigned n = 0;
+	ffi_type **t;
+
+	for (t = type->elements; *t != NULL; t++) {
+		n++;
+		if ((*t)->type == FFI_TYPE_STRUCT)
+			n += codec_count_(*t);
+	}
+	return n;
+}
+
+/* Fills fields starting from fields[n] for the struct type at type_idx,
+ * appending the keys to the table at keys_idx.  Returns the new n.
+ */
+static
+unsigned codec_compile_(lua_State *L, struct codec *c, unsigned n,
+	int type_idx, int keys_idx, size_t base)
+{
+	ffi_type *type = (ffi_type *) lua_touserdata(L, type_idx);
+	lua_Integer len, i;
+	size_t *offsets;
+	int names_idx;
+
+	luaL_checkstack(L, 4, NULL);
+	lua_getuservalue(L, type_idx);
+	len = lua_rawlen(L, -1);
+	offsets = (size_t *) &type->elements[len+1];
+	push_fieldnames_(L, -1);
+	names_idx = lua_gettop(L);
+	for (i = 1; i <= len; i++) {
+		struct codec_field *f = &c->fields[n];
+		ffi_type *t = type->elements[i-1];
+
+		if (lua_rawgeti(L, names_idx, i) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_pushinteger(L, i);
+		}
+		lua_rawseti(L, keys_idx, ++n);
+		f->offset = base + offsets[i-1];
+		f->type = t;
+		f->span = 0;
+		switch (t->type) {
+		case FFI_TYPE_STRUCT:
+			lua_rawgeti(L, names_idx - 1, i);
+			n = codec_compile_(L, c, n, lua_gettop(L), keys_idx,
+				f->offset);
+			f->span = n - (f - c->fields) - 1;
+			lua_pop(L, 1);
+			break;
+		case FFI_TYPE_POINTER:
+#define CASE(ffi_type, ...) case ffi_type:
+		INT_TYPE_LIST_(CASE)
+		FLOAT_TYPE_LIST_(CASE)
+#undef CASE
+			break;
+		default:
+			lua_rawgeti(L, keys_idx, n);
+			luaL_error(L, "field '%s' cannot be converted by a codec",
+				luaL_tolstring(L, -1, NULL));
+		}
+	}
+	lua_pop(L, 2);  /* field table and names */
+	return n;
+}
+
+/* Checks that the argument is an object of the codec's type.  Returns
+ * its memory and stores the number of elements in *len. */
+static
+char *codec_checkobj_(lua_State *L, int idx, struct codec *c, size_t *len)
+{
+	char *obj = (char *) checkobj_(L, idx, len);
+
+	lua_getuservalue(L, idx);
+	lua_getfield(L, lua_upvalueindex(2), "type");
+	luaL_argcheck(L, lua_rawequal(L, -1, -2), idx, "type mismatch");
+	lua_pop(L, 2);
+	*len /= c->type->size;
+	return obj;
+}
+
+/* Copies fields [from, to) from the table at tbl_idx to obj */
+static
+void codec_encode_(lua_State *L, struct codec *c, unsigned from, unsigned to,
+	int tbl_idx, char *obj)
+{
+	unsigned i;
+
+	luaL_checkstack(L, 4, NULL);
+	for (i = from; i < to; i++) {
+		struct codec_field *f = &c->fields[i];
+
+		lua_rawgeti(L, lua_upvalueindex(2), i+1);  /* key */
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, tbl_idx) == LUA_TNIL) {
+			/* absent fields are left untouched */
+		} else if (f->type->type == FFI_TYPE_STRUCT) {
+			if (lua_istable(L, -1)) {
+				codec_encode_(L, c, i+1, i+1 + f->span,
+					lua_gettop(L), obj);
+			}
+		} else if (cast2c_(L, -1, obj + f->offset, f->type) == 0) {
+			int key_idx = lua_gettop(L) - 1;
+			const char *key, *msg;
+
+			msg = push_casterror_(L, -1, f->type);
+			key = luaL_tolstring(L, key_idx, NULL);
+			luaL_error(L, "field '%s': %s", key, msg);
+		}
+		lua_pop(L, 2);
+		i += f->span;
+	}
+}
+
+/* Copies fields [from, to) from obj to the table at tbl_idx */
+static
+void codec_decode_(lua_State *L, struct codec *c, unsigned from, unsigned to,
+	int tbl_idx, char *obj)
+{
+	unsigned i;
+
+	luaL_checkstack(L, 3, NULL);
+	for (i = from; i < to; i++) {
+		struct codec_field *f = &c->fields[i];
+
+		lua_rawgeti(L, lua_upvalueindex(2), i+1);  /* key */
+		if (f->type->type == FFI_TYPE_STRUCT) {
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, tbl_idx) != LUA_TTABLE) {
+				/* reuse the nested table if present */
+				lua_pop(L, 1);
+				lua_createtable(L, 0, f->span);
+				lua_pushvalue(L, -2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, tbl_idx);
+			}
+			codec_decode_(L, c, i+1, i+1 + f->span,
+				lua_gettop(L), obj);
+			lua_pop(L, 2);
+			i += f->span;
+			continue;
+		}
+		cast2lua(L, obj + f->offset, f->type);
+		lua_rawset(L, tbl_idx);
+	}
+}
+
+/* encode(tbl, obj) -> obj */
+static
+int codec_encode(lua_State *L)
+{
+	struct codec *c = (struct codec *) lua_touserdata(L, lua_upvalueindex(1));
+	size_t len;
+	char *obj;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	obj = codec_checkobj_(L, 2, c, &len);
+	luaL_argcheck(L, len > 0, 2, "object is empty");
+	lua_settop(L, 2);
+	codec_encode_(L, c, 0, c->nfields, 1, obj);
+	return 1;
+}
+
+/* decode(obj [, tbl]) -> tbl */
+static
+int codec_decode(lua_State *L)
+{
+	struct codec *c = (struct codec *) lua_touserdata(L, lua_upvalueindex(1));
+	size_t len;
+	char *obj;
+
+	obj = codec_checkobj_(L, 1, c, &len);
+	luaL_argcheck(L, len > 0, 1, "object is empty");
+	if (lua_isnoneornil(L, 2)) {
+		lua_settop(L, 1);
+		lua_createtable(L, 0, c->nfields);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_settop(L, 2);
+	}
+	codec_decode_(L, c, 0, c->nfields, 2, obj);
+	return 1;
+}
+
+/* encodeall(list, arr) -> arr
+ *
+ * Encodes list[i] into the i-th element of arr.
+ */
+static
+int codec_encodeall(lua_State *L)
+{
+	struct codec *c = (struct codec *) lua_touserdata(L, lua_upvalueindex(1));
+	size_t len, i;
+	char *obj;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	obj = codec_checkobj_(L, 2, c, &len);
+	lua_settop(L, 2);
+	luaL_argcheck(L, lua_rawlen(L, 1) <= len, 1, "too many elements");
+	len = lua_rawlen(L, 1);
+	for (i = 0; i < len; i++) {
+		luaL_argcheck(L, lua_rawgeti(L, 1, i+1) == LUA_TTABLE, 1,
+			"expect a sequence of tables");
+		codec_encode_(L, c, 0, c->nfields, 3, obj + i * c->type->size);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/* decodeall(arr [, list]) -> list
+ *
+ * Decodes every element of arr into list, reusing the tables in it.
+ */
+static
+int codec_decodeall(lua_State *L)
+{
+	struct codec *c = (struct codec *) lua_touserdata(L, lua_upvalueindex(1));
+	size_t len, i;
+	char *obj;
+
+	obj = codec_checkobj_(L, 1, c, &len);
+	if (lua_isnoneornil(L, 2)) {
+		lua_settop(L, 1);
+		lua_createtable(L, len, 0);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_settop(L, 2);
+	}
+	for (i = 0; i < len; i++) {
+		if (lua_rawgeti(L, 2, i+1) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_createtable(L, 0, c->nfields);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, 2, i+1);
+		}
+		codec_decode_(L, c, 0, c->nfields, 3, obj + i * c->type->size);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+/* Makes a codec for a struct type.
+ *
+ * Arg 1: a struct type.
+ * Returns encode, decode, encodeall and decodeall functions.
+ */
+static
+int makecodec(lua_State *L)
+{
+	static const lua_CFunction fns[] = {
+		codec_encode, codec_decode, codec_encodeall, codec_decodeall,
+	};
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
+	struct codec *c;
+	unsigned n, i;
+
+	luaL_argcheck(L, type->type == FFI_TYPE_STRUCT, 1,
+		"type is not a struct");
+	lua_settop(L, 1);
+	n = codec_count_(type);
+	c = (struct codec *) lua_newuserdata(L, sizeof *c +
+		sizeof c->fields[0] * n);  /* 2 */
+	c->type = type;
+	c->nfields = n;
+	lua_createtable(L, n, 1);  /* 3: keys */
+	lua_pushvalue(L, 1);
+	lua_setfield(L, 3, "type");
+	codec_compile_(L, c, 0, 1, 3, 0);
+	lua_setuservalue(L, 2);
+	for (i = 0; i < sizeof fns / sizeof fns[0]; i++) {
+		lua_pushvalue(L, 2);
+		lua_getuservalue(L, 2);
+		lua_pushcclosure(L, fns[i], 2);
+	}
+	return i;
+}
+
+
+/** Frozen types and cifs
+ *
+ * Freezing copies a type or a cif, with everything it refers to, into
+ * memory outside any Lua state.  Frozen objects are immutable and never
+ * released, so any state on any thread may import them.
+ *
+ * A frozen struct type with N fields is allocated as:
+ * 	ffi_type type;
+ * 	ffi_type *elements[N+1];
+ * 	size_t offsets[N];
+ * 	char *names[N];
+ * 	char namebuf[];
+ * i.e. the layout of a struct type userdata, followed by the field names,
+ * all in one block.  The parts of a type or a cif are frozen before the
+ * block is allocated, so that an error while freezing leaks nothing.
+ * Importing a struct type makes a userdata holding a copy of the ffi_type
+ * only, so its elements and offsets are shared, not laid out again.
+ * Stock types are frozen as libFFI's own static ffi_type values.
+ *
+ * A frozen cif is a copy of the cif userdata, whose argument types are
+ * frozen types, followed by a struct ptrarg for each argument.  Importing
+ * it copies the cif, whose ffi_prep_cif results stay valid, points the
+ * argument types to the imported ones, and keeps the frozen cif where the
+ * ptrargs were, so the userdata is longer than that of a local cif.
+ *
+ * In each state, the table registry[frozen_tag] maps frozen objects (as
+ * light userdata) to local ones, and local objects that were frozen to
+ * frozen ones.  An imported object finds its frozen one by itself: the
+ * elements of a struct type follow its frozen ffi_type, and a cif keeps
+ * it.  The table is weak in both keys and values, so imported objects are
+ * collected when unused and imported again when needed; the stock types
+ * are anchored in the registry.
+ *
+ * The process-wide registry hashes the entries by name, or by the frozen
+ * object for anonymous ones, and by handle.
+ */
+
+struct frozen {
+	struct frozen *next;  /* in frozen_names */
+	struct frozen *hnext;  /* in frozen_handles */
+	char *name;  /* NULL if anonymous, or follows the struct */
+	ffi_type *type;  /* the frozen type, or NULL */
+	ffi_cif *cif;  /* the frozen cif, or NULL */
+};
+
+/* offset of the ptrargs in a frozen cif */
+#define ptrargs_(cif) ((struct ptrarg *) ((char *) (cif) + \
+	((cifsize_((cif)->nargs) + sizeof (void *) - 1) & ~(sizeof (void *) - 1))))
+/* the frozen cif of an imported one */
+#define origin_(cif) (*(ffi_cif **) ptrargs_(cif))
+
+#define FROZEN_NBUCKETS 256
+
+static struct frozen *frozen_names[FROZEN_NBUCKETS];
+static struct frozen *frozen_handles[FROZEN_NBUCKETS];
+
+#if defined(_WIN32)
+static SRWLOCK frozen_lock = SRWLOCK_INIT;
+# define frozen_lock_() AcquireSRWLockExclusive(&frozen_lock)
+# define frozen_unlock_() ReleaseSRWLockExclusive(&frozen_lock)
+#else
+static pthread_mutex_t frozen_lock = PTHREAD_MUTEX_INITIALIZER;
+# define frozen_lock_() pthread_mutex_lock(&frozen_lock)
+# define frozen_unlock_() pthread_mutex_unlock(&frozen_lock)
+#endif
+
+static
+unsigned frozen_hashp_(const void *p)
+{
+	return (unsigned) (((uintptr_t) p >> 4) * 2654435761u) %
+		FROZEN_NBUCKETS;
+}
+
+static
+unsigned frozen_hashs_(const char *s)
+{
+	uint32_t h = 2166136261u;  /* FNV-1a */
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h % FROZEN_NBUCKETS;
+}
+
+/* The bucket of frozen_names for a name, or for an anonymous type or cif */
+#define frozen_bucket_(name, type, cif) (&frozen_names[(name) != NULL ? \
+	frozen_hashs_(name) : frozen_hashp_((type) != NULL ? \
+		(void *) (type) : (void *) (cif))])
+
+static
+void *frozen_alloc_(lua_State *L, size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (p == NULL)
+		luaL_error(L, "not enough memory");
+	return p;
+}
+
+/* Looks up key in the frozen map; returns its type (nil if absent) */
+static
+int frozen_get_(lua_State *L, int key_idx)
+{
+	key_idx = lua_absindex(L, key_idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, frozen_tag);
+	lua_pushvalue(L, key_idx);
+	lua_rawget(L, -2);
+	lua_replace(L, -2);
+	return lua_type(L, -1);
+}
+
+/* Maps the frozen object p to the imported object at idx */
+static
+void frozen_setimport_(lua_State *L, int idx, void *p)
+{
+	idx = lua_absindex(L, idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, frozen_tag);
+	lua_pushlightuserdata(L, p);
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Maps the local object at idx and the frozen object p to each other */
+static
+void frozen_set_(lua_State *L, int idx, void *p)
+{
+	idx = lua_absindex(L, idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, frozen_tag);
+	lua_pushvalue(L, idx);
+	lua_pushlightuserdata(L, p);
+	lua_rawset(L, -3);
+	lua_pushlightuserdata(L, p);
+	lua_pushvalue(L, idx);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Freezes the type at idx */
+static
+ffi_type *freeze_type_(lua_State *L, int idx)
+{
+	ffi_type *type = totype_(L, idx), *t;
+	ffi_type **elements;
+	lua_Integer len, i;
+	size_t *offsets, namelen = 0;
+	char **names, *namebuf;
+
+	idx = lua_absindex(L, idx);
+	if (frozen_get_(L, idx) == LUA_TLIGHTUSERDATA) {
+		t = (ffi_type *) lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return t;
+	}
+	lua_pop(L, 1);
+	if (type->type != FFI_TYPE_STRUCT)
+		luaL_error(L, "cannot freeze this type");
+	if (type->elements != (ffi_type **) (type + 1))  /* imported */
+		return (ffi_type *) type->elements - 1;
+	luaL_checkstack(L, 4, NULL);
+	lua_getuservalue(L, idx);
+	len = lua_rawlen(L, -1);
+	push_fieldnames_(L, -1);
+	/* the frozen field types, and the size of the names */
+	elements = (ffi_type **) lua_newuserdata(L, sizeof *elements * len);
+	for (i = 0; i < len; i++) {
+		lua_rawgeti(L, -3, i+1);
+		elements[i] = freeze_type_(L, -1);
+		lua_pop(L, 1);
+		if (lua_rawgeti(L, -2, i+1) == LUA_TSTRING)
+			namelen += lua_rawlen(L, -1) + 1;
+		lua_pop(L, 1);
+	}
+	t = (ffi_type *) frozen_alloc_(L, sizeof *t +
+		sizeof (ffi_type *) * (len+1) + sizeof *offsets * len +
+		sizeof *names * len + namelen);
+	*t = *type;
+	t->elements = (ffi_type **) (t + 1);
+	offsets = (size_t *) &t->elements[len+1];
+	names = (char **) &offsets[len];
+	namebuf = (char *) &names[len];
+	memcpy(t->elements, elements, sizeof *elements * len);
+	t->elements[len] = NULL;
+	memcpy(offsets, &type->elements[len+1], sizeof *offsets * len);
+	for (i = 0; i < len; i++) {
+		if (lua_rawgeti(L, -2, i+1) == LUA_TSTRING) {
+			size_t n;
+			const char *name = lua_tolstring(L, -1, &n);
+
+			names[i] = memcpy(namebuf, name, n + 1);
+			namebuf += n + 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 3);
+	frozen_set_(L, idx, t);
+	return t;
+}
+
+/* Pushes the local type of the frozen type t, importing it if needed */
+static
+void import_type_(lua_State *L, ffi_type *t)
+{
+	ffi_type *type;
+	lua_Integer len, i;
+	char **names;
+
+	lua_pushlightuserdata(L, t);
+	if (frozen_get_(L, -1) == LUA_TUSERDATA) {
+		lua_replace(L, -2);
+		return;
+	}
+	lua_pop(L, 2);
+	/* only struct types are missing; stock ones are always mapped */
+	assert(t->type == FFI_TYPE_STRUCT);
+	luaL_checkstack(L, 4, NULL);
+	type = (ffi_type *) lua_newuserdata(L, sizeof *type);
+	*type = *t;
+	setmetatable_(L, type_tag);
+	for (len = 0; t->elements[len] != NULL; len++)
+		;
+	names = (char **) ((size_t *) &t->elements[len+1] + len);
+	lua_createtable(L, len, len);
+	for (i = 0; i < len; i++) {
+		import_type_(L, t->elements[i]);
+		lua_rawseti(L, -2, i+1);
+		if (names[i] != NULL) {
+			lua_pushinteger(L, i+1);
+			lua_setfield(L, -2, names[i]);
+		}
+	}
+	lua_setuservalue(L, -2);
+	frozen_setimport_(L, -1, t);
+}
+
+/* Freezes the cif at idx */
+static
+ffi_cif *freeze_cif_(lua_State *L, int idx)
+{
+	ffi_cif *cif = tocif_(L, idx), *c;
+	ffi_type *rtype, **types;
+	unsigned char *argflags = argflags_(cif);
+	struct ptrarg *ptrargs;
+	unsigned i;
+
+	idx = lua_absindex(L, idx);
+	if (frozen_get_(L, idx) == LUA_TLIGHTUSERDATA) {
+		c = (ffi_cif *) lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return c;
+	}
+	lua_pop(L, 1);
+	if (lua_rawlen(L, idx) > cifsize_(cif->nargs))  /* imported */
+		return origin_(cif);
+	luaL_checkstack(L, 4, NULL);
+	lua_getuservalue(L, idx);
+	rtype = (lua_getfield(L, -1, "ret") == LUA_TNIL) ?
+		&ffi_type_void : freeze_type_(L, -1);
+	lua_pop(L, 1);
+	/* the frozen argument types, or the types pointed to */
+	types = (ffi_type **) lua_newuserdata(L, sizeof *types * cif->nargs);
+	for (i = 0; i < cif->nargs; i++) {
+		lua_rawgeti(L, -2, i+1);
+		if (argflags[i] != 0)
+			lua_getuservalue(L, -1);
+		types[i] = freeze_type_(L, -1);
+		lua_pop(L, (argflags[i] != 0) ? 2 : 1);
+	}
+	c = (ffi_cif *) frozen_alloc_(L, (char *) ptrargs_(cif) - (char *) cif +
+		sizeof *ptrargs * cif->nargs);
+	memcpy(c, cif, cifsize_(cif->nargs));
+	ptrargs = ptrargs_(c);
+	c->arg_types = (ffi_type **) (c + 1);
+	c->rtype = rtype;
+	for (i = 0; i < cif->nargs; i++) {
+		if (argflags[i] == 0) {
+			c->arg_types[i] = types[i];
+		} else {
+			lua_rawgeti(L, -2, i+1);
+			ptrargs[i] = *(struct ptrarg *) lua_touserdata(L, -1);
+			ptrargs[i].type = types[i];
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
+	frozen_set_(L, idx, c);
+	return c;
+}
+
+/* Pushes the local cif of the frozen cif c, importing it if needed */
+static
+void import_cif_(lua_State *L, ffi_cif *c)
+{
+	ffi_cif *cif;
+	ffi_type **atypes;
+	unsigned char *argflags;
+	unsigned i;
+
+	lua_pushlightuserdata(L, c);
+	if (frozen_get_(L, -1) == LUA_TUSERDATA) {
+		lua_replace(L, -2);
+		return;
+	}
+	lua_pop(L, 2);
+	luaL_checkstack(L, 4, NULL);
+	cif = (ffi_cif *) lua_newuserdata(L, (char *) ptrargs_(c) - (char *) c +
+		sizeof (ffi_cif *));
+	memcpy(cif, c, cifsize_(c->nargs));
+	origin_(cif) = c;
+	setmetatable_(L, cif_tag);
+	atypes = (ffi_type **) (cif + 1);
+	argflags = argflags_(cif);
+	cif->arg_types = atypes;
+	lua_createtable(L, cif->nargs, 1);
+	import_type_(L, c->rtype);
+	cif->rtype = totype_(L, -1);
+	lua_setfield(L, -2, "ret");
+	for (i = 0; i < cif->nargs; i++) {
+		if (argflags[i] == 0) {
+			import_type_(L, atypes[i]);
+			atypes[i] = totype_(L, -1);
+		} else {
+			struct ptrarg *pa = (struct ptrarg *)
+				lua_newuserdata(L, sizeof *pa);
+
+			*pa = ptrargs_(c)[i];
+			setmetatable_(L, ptrarg_tag);
+			import_type_(L, pa->type);
+			pa->type = totype_(L, -1);
+			lua_setuservalue(L, -2);
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_setuservalue(L, -2);
+	frozen_setimport_(L, -1, c);
+}
+
+/* Freezes a type or a cif.
+ *
+ * Arg 1: a type or a cif.
+ * Arg 2: (optional) a name to register it under.
+ * Returns a handle (light userdata), which is valid in every state.
+ */
+static
+int freeze(lua_State *L)
+{
+	const char *name = luaL_optstring(L, 2, NULL);
+	struct frozen *f, *p, **bucket;
+	int same;
+
+	ffi_type *type = NULL;
+	ffi_cif *cif = NULL;
+
+	if (testudata_(L, 1, cif_tag) == NULL)
+		checkudata_(L, 1, type_tag);
+	lua_settop(L, 2);
+	if (testudata_(L, 1, cif_tag) != NULL) {
+		cif = freeze_cif_(L, 1);
+	} else {
+		type = freeze_type_(L, 1);
+	}
+	/* nothing raises from here until f is either listed or freed */
+	f = (struct frozen *) calloc(1, sizeof *f +
+		((name != NULL) ? strlen(name) + 1 : 0));
+	if (f == NULL)
+		return luaL_error(L, "not enough memory");
+	f->type = type;
+	f->cif = cif;
+	if (name != NULL)
+		f->name = strcpy((char *) (f + 1), name);
+	bucket = frozen_bucket_(name, type, cif);
+	frozen_lock_();
+	for (p = *bucket; p != NULL; p = p->next) {
+		if ((name != NULL) ?
+				(p->name != NULL && strcmp(p->name, name) == 0) :
+				(p->name == NULL && p->type == f->type &&
+				 p->cif == f->cif)) {
+			break;
+		}
+	}
+	if (p == NULL) {
+		struct frozen **h = &frozen_handles[frozen_hashp_(f)];
+
+		f->next = *bucket;
+		*bucket = f;
+		f->hnext = *h;
+		*h = p = f;
+	}
+	frozen_unlock_();
+	if (p != f) {
+		same = (p->type == f->type && p->cif == f->cif);
+		free(f);
+		luaL_argcheck(L, same, 2, "name already frozen");
+	}
+	lua_pushlightuserdata(L, p);
+	return 1;
+}
+
+/* Imports a frozen type or cif.
+ *
+ * Arg 1: a handle returned by freeze, or the name given to it.
+ * Returns the type or the cif, or nil if there is no such name.
+ */
+static
+int import(lua_State *L)
+{
+	const char *name = NULL;
+	void *handle = NULL;
+	struct frozen *p;
+
+	if (lua_islightuserdata(L, 1)) {
+		handle = lua_touserdata(L, 1);
+	} else {
+		name = luaL_checkstring(L, 1);
+	}
+	frozen_lock_();
+	if (handle != NULL) {
+		for (p = frozen_handles[frozen_hashp_(handle)]; p != NULL;
+				p = p->hnext) {
+			if ((void *) p == handle)
+				break;
+		}
+	} else {
+		for (p = frozen_names[frozen_hashs_(name)]; p != NULL;
+				p = p->next) {
+			if (p->name != NULL && strcmp(p->name, name) == 0)
+				break;
+		}
+	}
+	frozen_unlock_();
+	if (p == NULL) {
+		luaL_argcheck(L, handle == NULL, 1, "invalid handle");
+		lua_pushnil(L);
+	} else if (p->cif != NULL) {
+		import_cif_(L, p->cif);
+	} else {
+		import_type_(L, p->type);
+	}
+	return 1;
+}
+
+
+/** Transferable buffers and channels
+ *
+ * ffi.buffer(T, n) allocates n elements of T outside the Lua heap, as a
+ * view that owns the memory.  ffi.detach(buf) takes the memory away from
+ * the buffer, leaving it invalid, and returns a handle (light userdata)
+ * that any state on any thread may adopt with ffi.attach(handle, T).  A
+ * handle must be attached exactly once.  Cursors and unchecked views made
+ * over a buffer are invalidated when it is detached.
+ *
+ * The memory is a struct xfer followed by the data, so a handle is a
+ * single pointer that C code may pass around as well.
+ *
+ * A channel is a bounded multi-producer, multi-consumer queue of handles
+ * (or any light userdata) living outside any state.  ffi.channel(n) makes
+ * one of capacity n, and ffi.channel(ch:handle()) opens it in another
+ * state.  A handle holds a reference to the channel, which opening it
+ * adopts, so each handle must be opened exactly once.  The channel is
+ * released when the last reference goes.
+ */
+
+struct xfer {
+	size_t size;  /* of the data */
+};
+
+/* the data starts here, aligned for any scalar type */
+#define XFER_HEADER ((sizeof (struct xfer) + 15) & ~(size_t) 15)
+#define xfer_data_(x) ((char *) (x) + XFER_HEADER)
+
+struct buffer {
+	struct view v;  /* must be first */
+	struct xfer *x;  /* NULL if detached */
+};
+
+static
+struct xfer *xfer_alloc_(lua_State *L, size_t size)
+{
+	struct xfer *x;
+
+	if (size > (size_t) -1 - XFER_HEADER ||
+			(x = (struct xfer *) malloc(XFER_HEADER + size)) == NULL)
+		luaL_error(L, "not enough memory");
+	x->size = size;
+	return x;
+}
+
+/* Makes a buffer owning x, of the type at type_idx */
+static
+void newbuffer_(lua_State *L, struct xfer *x, int type_idx)
+{
+	struct buffer *b;
+
+	type_idx = lua_absindex(L, type_idx);
+	b = (struct buffer *) lua_newuserdata(L, sizeof *b);
+	b->x = NULL;
+	setmetatable_(L, buffer_tag);
+	lua_pushvalue(L, type_idx);
+	lua_setuservalue(L, -2);
+	b->x = x;
+	b->v.ptr = xfer_data_(x);
+	b->v.size = x->size;
+	external_(L, x->size);
+}
+
+/* Allocates a transferable buffer.
+ *
+ * Arg 1: Type.
+ * Arg 2: N (default: 1).
+ * Returns a view of N zeroed values of the type.
+ */
+static
+int makebuffer(lua_State *L)
+{
+	ffi_type *type = (ffi_type *) checkudata_(L, 1, type_tag);
+	lua_Integer n = luaL_optinteger(L, 2, 1);
+	struct xfer *x;
+
+	luaL_argcheck(L, type->size > 0, 1, "type has no size");
+	luaL_argcheck(L, n > 0 && (size_t) n <= (size_t) -1 / type->size,
+		2, "invalid length");
+	x = xfer_alloc_(L, type->size * n);
+	memset(xfer_data_(x), 0, x->size);
+	newbuffer_(L, x, 1);
+	return 1;
+}
+
+/* buffer.__gc */
+static
+int buffer_gc(lua_State *L)
+{
+	struct buffer *b = (struct buffer *) checkudata_(L, 1, buffer_tag);
+
+	if (b->x != NULL) {
+		external_(L, -(lua_Integer) b->x->size);
+		free(b->x);
+		b->x = NULL;
+		b->v.ptr = NULL;
+		b->v.size = 0;
+	}
+	return 0;
+}
+
+/* Invalidates the views of the buffer at idx */
+static
+void invalidate_bufviews_(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, bufviews_tag);
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) == LUA_TTABLE) {
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			struct view *v = (struct view *) lua_touserdata(L, -2);
+
+			v->ptr = NULL;
+			v->size = 0;
+			lua_pop(L, 1);
 		}
-		break;
-#undef CASE
-	case FFI_TYPE_POINTER:
-		p = *(void **) addr;
-		(p == NULL) ? lua_pushnil(L) : lua_pushlightuserdata(L, p);
-		return;
+		lua_pushvalue(L, idx);
+		lua_pushnil(L);
+		lua_rawset(L, -4);
 	}
-	luaL_error(L, "cannot cast result to lua value");
+	lua_pop(L, 2);
 }
 
-/* For extra values in a vararg call, use these default types.
+/* Detaches the memory of a buffer.
  *
- * Note: it's currently impossible to pass an integer longer than int
- * in vararg, so printf("%ld") won't work.
+ * Arg 1: a buffer, or any other object or view, whose memory is copied
+ *        once into a new block instead.
+ * Returns the handle.
  */
 static
-ffi_type *default_type_(lua_State *L, int idx)
+int detach(lua_State *L)
 {
-	int ltype = lua_type(L, idx);
+	struct buffer *b = (struct buffer *) testudata_(L, 1, buffer_tag);
+	struct xfer *x;
+	size_t len;
+	void *obj;
 
-	switch (ltype) {
-		case LUA_TNIL: /* as NULL pointer */
-		case LUA_TSTRING: /* as const char * */
-		case LUA_TLIGHTUSERDATA:
-		case LUA_TUSERDATA:
-			return &ffi_type_pointer;
-		case LUA_TBOOLEAN: /* as int */
-			return &ffi_type_sint;
-		case LUA_TNUMBER:
-			return (lua_isinteger(L, idx)) ?
-				&ffi_type_sint : &ffi_type_double;
-		default:
-			return &ffi_type_void;
+	if (b != NULL) {
+		luaL_argcheck(L, b->x != NULL, 1, "buffer is detached");
+		x = b->x;
+		external_(L, -(lua_Integer) x->size);
+		b->x = NULL;
+		b->v.ptr = NULL;
+		b->v.size = 0;
+		invalidate_bufviews_(L, 1);
+	} else {
+		obj = checkobj_(L, 1, &len);
+		luaL_argcheck(L, obj != NULL, 1, "view is not valid");
+		x = xfer_alloc_(L, len);
+		memcpy(xfer_data_(x), obj, len);
 	}
+	lua_pushlightuserdata(L, x);
+	return 1;
 }
 
+/* Adopts a detached buffer.
+ *
+ * Arg 1: the handle.
+ * Arg 2: Type, whose size must divide that of the buffer.
+ * Returns the buffer.
+ */
 static
-int funccall(lua_State *L)
+int attach(lua_State *L)
 {
-	lua_CFunction fn;
-	ffi_cif *cif;
-	ffi_type *rtype = NULL, **atypes = NULL;
-	void **args;
-	void *rvalue = NULL;
-	ffi_status status = FFI_OK;
-	unsigned ntotalargs = lua_gettop(L);
-	unsigned i;
-	int rtype_idx = 0;
+	struct xfer *x = (struct xfer *) lua_touserdata(L, 1);
+	ffi_type *type = (ffi_type *) checkudata_(L, 2, type_tag);
 
-	fn = lua_tocfunction(L, lua_upvalueindex(2));
-	if (fn == NULL) {
-		return luaL_error(L, "expect function, got %s",
-			lua_typename(L, lua_type(L, -1)));
-	}
-	cif = (ffi_cif *) luaL_checkudata(L, lua_upvalueindex(1), "ffi_cif");
-	lua_getuservalue(L, lua_upvalueindex(1));
-	luaL_checktype(L, -1, LUA_TTABLE);
-	lua_getfield(L, -1, "ret");
-	lua_replace(L, -2);
-	rtype = cif->rtype;
-	rtype_idx = lua_gettop(L);
-	args = (void **) alloca(sizeof args[0] * ntotalargs);
-	if (ntotalargs > cif->nargs) {
-		atypes = (ffi_type **) alloca(sizeof atypes[0] * ntotalargs);
-	} else if (ntotalargs < cif->nargs) {
-		luaL_error(L, "expect %d arguments, got %d", cif->nargs,
-			ntotalargs);
-	}
-	for (i = 0; i < ntotalargs; i++) {
-		ffi_type *type = (cif && i < cif->nargs) ?
-			cif->arg_types[i] : default_type_(L, i+1);
-		if (atypes != NULL) {
-			atypes[i] = type;
-		}
-		args[i] = alloca(type->size);
-		cast2c(L, i+1, args[i], type);
-	}
-	if (ntotalargs > cif->nargs) {
-		int nfixedargs = cif->nargs;
-		cif = (ffi_cif *) alloca(sizeof *cif);
-		status = ffi_prep_cif_var(cif, FFI_DEFAULT_ABI, nfixedargs,
-			ntotalargs, rtype, atypes);
-	}
-	if (status != FFI_OK) {
-		return luaL_error(L, "failed to prepare cif");
-	}
-	assert(cif->rtype == rtype);
-	switch (rtype->type) {
-		case FFI_TYPE_VOID:
-			ffi_call(cif, FFI_FN(*fn), NULL, args);
-			return 0;
-		case FFI_TYPE_STRUCT:
-		case FFI_TYPE_COMPLEX:
-			assert(rtype_idx != 0);
-			rvalue = lua_newuserdata(L,
-				(rtype->size > sizeof (ffi_arg) ?
-					rtype->size : sizeof (ffi_arg)));
-			initobj_(L, rtype_idx);
-			ffi_call(cif, FFI_FN(*fn), rvalue, args);
-			return 1;
+	luaL_argcheck(L, lua_islightuserdata(L, 1) && x != NULL, 1,
+		"expect a handle");
+	luaL_argcheck(L, type->size > 0 && x->size % type->size == 0, 2,
+		"size mismatch");
+	newbuffer_(L, x, 2);
+	return 1;
+}
+
+#if defined(_WIN32)
+# define chan_destroy_(ch) ((void) 0)
+# define chan_lock_(ch) AcquireSRWLockExclusive(&(ch)->lock)
+# define chan_unlock_(ch) ReleaseSRWLockExclusive(&(ch)->lock)
+# define chan_wait_(ch, c) \
+	SleepConditionVariableSRW(&(ch)->c, &(ch)->lock, INFINITE, 0)
+# define chan_signal_(ch, c) WakeConditionVariable(&(ch)->c)
+# define chan_broadcast_(ch, c) WakeAllConditionVariable(&(ch)->c)
+#else
+# define chan_destroy_(ch) (pthread_mutex_destroy(&(ch)->lock), \
+	pthread_cond_destroy(&(ch)->notfull), \
+	pthread_cond_destroy(&(ch)->notempty))
+# define chan_lock_(ch) pthread_mutex_lock(&(ch)->lock)
+# define chan_unlock_(ch) pthread_mutex_unlock(&(ch)->lock)
+# define chan_wait_(ch, c) pthread_cond_wait(&(ch)->c, &(ch)->lock)
+# define chan_signal_(ch, c) pthread_cond_signal(&(ch)->c)
+# define chan_broadcast_(ch, c) pthread_cond_broadcast(&(ch)->c)
+#endif
+
+struct channel {
+	atomic_int refs;  /* number of states holding it */
+#if defined(_WIN32)
+	SRWLOCK lock;
+	CONDITION_VARIABLE notfull, notempty;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t notfull, notempty;
+#endif
+	int closed;
+	size_t cap, head, count;
+	void *items[1];
+};
+
+/* Returns 0 on success */
+static
+int chan_init_(struct channel *ch)
+{
+#if defined(_WIN32)
+	InitializeSRWLock(&ch->lock);
+	InitializeConditionVariable(&ch->notfull);
+	InitializeConditionVariable(&ch->notempty);
+	return 0;
+#else
+	if (pthread_mutex_init(&ch->lock, NULL) != 0)
+		return -1;
+	if (pthread_cond_init(&ch->notfull, NULL) != 0) {
+		pthread_mutex_destroy(&ch->lock);
+		return -1;
 	}
-	if (rtype->size > sizeof (ffi_arg)) {
-		return luaL_error(L, "return value not supported");
+	if (pthread_cond_init(&ch->notempty, NULL) != 0) {
+		pthread_cond_destroy(&ch->notfull);
+		pthread_mutex_destroy(&ch->lock);
+		return -1;
 	}
-	rvalue = (ffi_arg *) alloca(sizeof (ffi_arg));
-	ffi_call(cif, FFI_FN(*fn), rvalue, args);
-	cast2lua(L, rvalue, rtype);
-	return 1;
+	return 0;
+#endif
 }
 
+static
+struct channel *checkchannel_(lua_State *L, int idx)
+{
+	struct channel **p = (struct channel **) checkudata_(L, idx,
+		channel_tag);
 
-/* Loads a library.
+	if (*p == NULL)
+		luaL_argerror(L, idx, "channel is released");
+	return *p;
+}
+
+/* Makes or opens a channel.
  *
- * Arg 1: path to the shared library.
- * Arg 2: a table.  Any element in this table of type ffi_cif will be converted
- *        into a function that calls the function named as the key.
- * Returns the table.
+ * Arg 1: the capacity, or a handle from ch:handle(), whose reference the
+ *        new channel object adopts.
+ * Returns the channel.
  */
 static
-int loadlib(lua_State *L)
+int makechannel(lua_State *L)
 {
-	luaL_checktype(L, 1, LUA_TSTRING);
-	luaL_checktype(L, 2, LUA_TTABLE);
-	lua_settop(L, 2);
+	struct channel **p, *ch;
 
-	luaL_requiref(L, "package", luaopen_package, 0);
-	lua_getfield(L, -1, "loadlib");
-	if (!lua_isfunction(L, -1)) {
-		return luaL_error(L, "cannot find package.loadlib");
-	}
-	lua_replace(L, -2);  /* 3: package.loadlib */
-	lua_pushnil(L);
-	while (lua_next(L, 2) != 0) {
-		/* 4: key;  5: value */
-		if (lua_type(L, 4) != LUA_TSTRING ||
-				!luaL_testudata(L, 5, "ffi_cif")) {
-			lua_pop(L, 1);
-			continue;
-		}
-		lua_pushvalue(L, 3);
-		lua_pushvalue(L, 1);
-		lua_pushvalue(L, 4);
-		lua_call(L, 2, LUA_MULTRET);  /* package.loadlib(libname, key) */
-		/* 4:name 5:cif 6:(cfunc|true|nil 7:err1 err2) */
-		if (lua_isnil(L, 6)) {
-			lua_settop(L, 7);
-			return lua_error(L);
-		}
-		if (!lua_iscfunction(L, 6)) {
-			return luaL_error(L, "cannot load '%s'",
-				lua_tostring(L, 4));
+	p = (struct channel **) lua_newuserdata(L, sizeof *p);
+	*p = NULL;
+	setmetatable_(L, channel_tag);
+	if (lua_islightuserdata(L, 1)) {
+		ch = (struct channel *) lua_touserdata(L, 1);
+		luaL_argcheck(L, ch != NULL, 1, "expect a handle");
+	} else {
+		lua_Integer n = luaL_checkinteger(L, 1);
+
+		luaL_argcheck(L, n > 0 && (size_t) n <
+			((size_t) -1 - sizeof *ch) / sizeof ch->items[0], 1,
+			"invalid capacity");
+		ch = (struct channel *) malloc(sizeof *ch +
+			sizeof ch->items[0] * (n - 1));
+		if (ch == NULL)
+			return luaL_error(L, "not enough memory");
+		if (chan_init_(ch) != 0) {
+			free(ch);
+			return luaL_error(L, "cannot initialize channel");
 		}
-		lua_pushcclosure(L, funccall, 2);
-		/* 4:name 5:func */
-		lua_pushvalue(L, 4);
-		lua_insert(L, 5);
-		lua_rawset(L, 2);
-		/* 4:name */
+		atomic_init(&ch->refs, 1);
+		ch->closed = 0;
+		ch->cap = n;
+		ch->head = ch->count = 0;
 	}
-	lua_settop(L, 2);
+	*p = ch;
 	return 1;
 }
 
-
-/** FFI closure
- *
- * Provides a callback to the foreign function.
+/* ch:send(v [, wait]) -> true, or false if full and not waiting
+ * v is a light userdata; wait defaults to true.
  */
+static
+int channel_send(lua_State *L)
+{
+	struct channel *ch = checkchannel_(L, 1);
+	int wait = lua_isnone(L, 3) || lua_toboolean(L, 3);
+	void *v = lua_touserdata(L, 2);
+	int ok = 0;
 
-/* The entry point of the closure.  This function reads closure info
- * from user_data, converts the arguments and calls the coresponding function.
+	luaL_argcheck(L, lua_islightuserdata(L, 2), 2,
+		"expect light userdata");
+	chan_lock_(ch);
+	while (wait && !ch->closed && ch->count == ch->cap)
+		chan_wait_(ch, notfull);
+	if (!ch->closed && ch->count < ch->cap) {
+		ch->items[(ch->head + ch->count++) % ch->cap] = v;
+		chan_signal_(ch, notempty);
+		ok = 1;
+	}
+	chan_unlock_(ch);
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+/* ch:recv([wait]) -> v, or nil if empty and not waiting, or closed
+ * wait defaults to true.
  */
 static
-void closureproxy(ffi_cif *cif, void *ret, void **args, void *user_data)
+int channel_recv(lua_State *L)
 {
-	struct closure *cl = (struct closure *) user_data;
-	lua_State *L = cl->L;
-	unsigned nargs = cif->nargs;
-	unsigned i;
-	ffi_type *rtype = cif->rtype;
+	struct channel *ch = checkchannel_(L, 1);
+	int wait = lua_isnone(L, 2) || lua_toboolean(L, 2);
+	void *v = NULL;
+	int ok = 0;
 
-	luaL_checkstack(L, nargs + 3, NULL);
-	lua_rawgeti(L, LUA_REGISTRYINDEX, cl->fn_ref);
-	/* push arguments */
-	for (i = 0; i < nargs; i++) {
-		cast2lua(L, args[i], cif->arg_types[i]);
-	}
-	if (rtype->type != FFI_TYPE_VOID) {
-		lua_call(L, nargs, 1);
-		cast2c(L, -1, ret, rtype);
-		lua_pop(L, 1); /* pop return value from lua stack */
-	} else {
-		lua_call(L, nargs, 0);
+	chan_lock_(ch);
+	while (wait && !ch->closed && ch->count == 0)
+		chan_wait_(ch, notempty);
+	if (ch->count > 0) {
+		v = ch->items[ch->head];
+		ch->head = (ch->head + 1) % ch->cap;
+		ch->count--;
+		chan_signal_(ch, notfull);
+		ok = 1;
 	}
+	chan_unlock_(ch);
+	if (!ok)
+		return 0;
+	lua_pushlightuserdata(L, v);
+	return 1;
 }
 
-/* Creates a FFI closure from a function.
+/* ch:close(); further sends fail, and receives fail once it is empty.
+ * Waiting senders and receivers are woken up.
  */
 static
-int makeclosure(lua_State *L)
+int channel_close(lua_State *L)
 {
-	struct closure *cl;
-	ffi_status status;
-	ffi_cif *cif;
+	struct channel *ch = checkchannel_(L, 1);
 
-	cif = (ffi_cif *) luaL_checkudata(L, 1, "ffi_cif");
-	cl = (struct closure *) lua_newuserdata(L, sizeof *cl);
-	luaL_setmetatable(L, "ffi_closure");
-	lua_pushvalue(L, 1);
-	lua_setuservalue(L, -2);
-	cl->L = L;
-	luaL_checktype(L, 2, LUA_TFUNCTION);
-	lua_pushvalue(L, 2);
-	cl->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	cl->closure = (ffi_closure *) ffi_closure_alloc(sizeof *cl->closure,
-		&cl->exec_addr);
-	if (cl->closure == NULL) {
-		return luaL_error(L, "cannot allocate closure");
-	}
-	status = ffi_prep_closure_loc(cl->closure, cif, closureproxy, cl,
-		cl->exec_addr);
-	if (status != FFI_OK) {
-		return luaL_error(L, "failed to prepare closure");
-	}
+	chan_lock_(ch);
+	ch->closed = 1;
+	chan_broadcast_(ch, notfull);
+	chan_broadcast_(ch, notempty);
+	chan_unlock_(ch);
+	return 0;
+}
+
+/* ch:handle() -> light userdata for ffi.channel in another state
+ * The handle holds a new reference to the channel.
+ */
+static
+int channel_handle(lua_State *L)
+{
+	struct channel *ch = checkchannel_(L, 1);
+
+	atomic_fetch_add(&ch->refs, 1);
+	lua_pushlightuserdata(L, ch);
 	return 1;
 }
 
-/* closure.__gc */
+/* #ch: number of queued items */
 static
-int closuregc(lua_State *L)
+int channel_len(lua_State *L)
 {
-	struct closure *cl = (struct closure *) luaL_checkudata(L, 1, "ffi_closure");
+	struct channel *ch = checkchannel_(L, 1);
+	size_t n;
 
-	if (cl->closure) {
-		ffi_closure_free(cl->closure);
-		cl->closure = NULL;
-	}
-	if (cl->fn_ref != LUA_NOREF) {
-		luaL_unref(L, LUA_REGISTRYINDEX, cl->fn_ref);
-		cl->fn_ref = LUA_NOREF;
+	chan_lock_(ch);
+	n = ch->count;
+	chan_unlock_(ch);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/* channel.__gc: releases the channel when no state holds it.  Items
+ * still queued are dropped. */
+static
+int channel_gc(lua_State *L)
+{
+	struct channel **p = (struct channel **) checkudata_(L, 1,
+		channel_tag);
+
+	if (*p != NULL && atomic_fetch_sub(&(*p)->refs, 1) == 1) {
+		chan_destroy_(*p);
+		free(*p);
 	}
+	*p = NULL;
 	return 0;
 }
 
-/* closure.__tostring */
+/* channel.__tostring */
 static
-int closure_tostr(lua_State *L)
+int channel_tostr(lua_State *L)
 {
-	struct closure *cl;
-	ffi_cif *cif;
-	luaL_Buffer B;
-
-	cl = (struct closure *) luaL_checkudata(L, 1, "ffi_closure");
+	struct channel **p = (struct channel **) checkudata_(L, 1,
+		channel_tag);
 
-	luaL_buffinit(L, &B);
-	lua_pushfstring(L, "ffi_closure %p <", cl);
-	luaL_addvalue(&B);
-	lua_getuservalue(L, 1);
-	cif = luaL_checkudata(L, -1, "ffi_cif");
-	add_cif(&B, cif);
-	luaL_addchar(&B, '>');
-	luaL_pushresult(&B);
+	lua_pushfstring(L, "ffi_channel: %p", *p);
 	return 1;
 }
 
@@ -990,7 +5668,18 @@ void define_type(lua_State *L, int table, const char *name, ffi_type *type)
 {
 	ffi_type *t = (ffi_type *) lua_newuserdata(L, sizeof (ffi_type));
 	*t = *type;
-	luaL_setmetatable(L, "ffi_type");
+	setmetatable_(L, type_tag);
+	/* stock types freeze to and import from libFFI's own */
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, type);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, frozen_tag);
+	lua_pushvalue(L, -2);
+	lua_pushlightuserdata(L, type);
+	lua_rawset(L, -3);
+	lua_pushlightuserdata(L, type);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
 	lua_setfield(L, table, name);
 }
 
@@ -1073,6 +5762,36 @@ int luaopen_ffi(lua_State *L)
 		{"deref", deref},
 		{"ref", ref_offset},
 		{"closure", makeclosure},
+		{"reader", reader},
+		{"writer", writer},
+		{"codec", makecodec},
+		{"out", makeout},
+		{"ptr", makeptr},
+		{"pipeline", makepipeline},
+		{"atomic_load", atomic_load_},
+		{"atomic_store", atomic_store_},
+		{"atomic_add", atomic_add_},
+		{"atomic_exchange", atomic_exchange_},
+		{"atomic_cas", atomic_cas_},
+		{"callinto", callinto},
+		{"freeze", freeze},
+		{"array", array},
+		{"unchecked", unchecked},
+		{"sort", sort},
+		{"memstats", memstats},
+		{"search", search},
+		{"cursor", makecursor},
+		{"each", each},
+		{"buffer", makebuffer},
+		{"detach", detach},
+		{"attach", attach},
+		{"channel", makechannel},
+		{"bind", bind},
+		{"vtable", vtable},
+		{"memoize", memoize},
+		{"trace", trace},
+		{"tracedump", tracedump},
+		{"import", import},
 		{NULL, NULL},
 	};
 	static const luaL_Reg cif_reg[] = {
@@ -1097,16 +5816,165 @@ int luaopen_ffi(lua_State *L)
 		{"__tostring", closure_tostr},
 		{NULL, NULL},
 	};
+	static const luaL_Reg view_reg[] = {
+		{"__index", objindex},
+		{"__newindex", obj_newindex},
+		{"__len", obj_len},
+		{"__tostring", obj_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg ptrarg_reg[] = {
+		{NULL, NULL},
+	};
+	static const luaL_Reg pipeline_reg[] = {
+		{"__call", pipeline_call},
+		{"__tostring", pipeline_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg cursor_reg[] = {
+		{"__index", cursor_index},
+		{"__newindex", cursor_newindex},
+		{"__len", obj_len},
+		{"__tostring", cursor_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg buffer_reg[] = {
+		{"__index", objindex},
+		{"__newindex", obj_newindex},
+		{"__len", obj_len},
+		{"__tostring", obj_tostr},
+		{"__gc", buffer_gc},
+		{NULL, NULL},
+	};
+	static const luaL_Reg channel_reg[] = {
+		{"__len", channel_len},
+		{"__gc", channel_gc},
+		{"__tostring", channel_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg channel_methods[] = {
+		{"send", channel_send},
+		{"recv", channel_recv},
+		{"close", channel_close},
+		{"handle", channel_handle},
+		{NULL, NULL},
+	};
+	static const luaL_Reg memo_reg[] = {
+		{"__call", memo_call},
+		{"__gc", memo_gc},
+		{"__tostring", memo_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg memo_methods[] = {
+		{"stats", memo_stats},
+		{"clear", memo_clear},
+		{NULL, NULL},
+	};
+	static const luaL_Reg stream_reg[] = {
+		{"__call", stream_read},
+		{"__gc", stream_close},
+		{"__tostring", stream_tostr},
+		{NULL, NULL},
+	};
+	static const luaL_Reg stream_methods[] = {
+		{"read", stream_read},
+		{"write", stream_write},
+		{"flush", stream_flush},
+		{"close", stream_close},
+		{NULL, NULL},
+	};
+
+	int cached = mtcache_own_(L);
 
 #define INIT(X) \
-	luaL_newmetatable(L, "ffi_" #X); \
-	luaL_setfuncs(L, X##_reg, 0);
+	newmetatable_(L, X##_tag); \
+	luaL_setfuncs(L, X##_reg, 0); \
+	if (cached) \
+		atomic_store(&mtcache_[mtslot_(X##_tag)], lua_topointer(L, -1));
 
-	INIT(cif); INIT(type); INIT(obj); INIT(closure);
+	INIT(cif); INIT(type); INIT(obj); INIT(closure); INIT(ptrarg);
+	INIT(view); INIT(pipeline); INIT(cursor);
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, -2, view_tag);  /* a cursor is also a view */
+	INIT(buffer);
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, -2, view_tag);  /* so is a buffer */
+	INIT(channel);
+	luaL_newlib(L, channel_methods);
+	lua_setfield(L, -2, "__index");
+	INIT(memo);
+	luaL_newlib(L, memo_methods);
+	lua_setfield(L, -2, "__index");
+	INIT(stream);
 #undef INIT
+	luaL_newlib(L, stream_methods);
+	lua_setfield(L, -2, "__index");  /* of the stream metatable */
+
+	/* maps between local objects and frozen ones, both ways */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "kv");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, frozen_tag);
+
+	/* weak-keyed tables: anchors, array metatables, bound functions and
+	 * views of buffers */
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, anchor_tag);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, array_tag);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, uarray_tag);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, bind_tag);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, bufviews_tag);
+
+	/* memory statistics, with weak-keyed types and variants tables */
+	memset(lua_newuserdata(L, sizeof (struct memstats)), 0,
+		sizeof (struct memstats));
+	lua_createtable(L, 2, 0);
+	lua_newtable(L);
+	lua_pushvalue(L, -4);
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, -2, 1);
+	lua_newtable(L);
+	lua_pushvalue(L, -4);
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, -2, 2);
+	lua_setuservalue(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, memstats_tag);
+	lua_pop(L, 1);
 
 	luaL_newlib(L, lib_reg);
 	define_types(L, lua_gettop(L));
+	lua_getfield(L, -1, "pointer");
+	lua_pushcclosure(L, strarray, 1);
+	lua_setfield(L, -2, "strarray");
+
+	/* placeholders in pipeline stages */
+	lua_pushlightuserdata(L, (void *) pipe_input);
+	lua_setfield(L, -2, "input");
+	lua_pushlightuserdata(L, (void *) pipe_inlen);
+	lua_setfield(L, -2, "inlen");
+	lua_pushlightuserdata(L, (void *) pipe_output);
+	lua_setfield(L, -2, "output");
+	lua_pushlightuserdata(L, (void *) pipe_outsize);
+	lua_setfield(L, -2, "outsize");
 
 	return 1;
 }
@@ -0,0 +1,58 @@
+-- Times callbacks from native code into Lua.
+--
+-- To compare two builds of the module, e.g. with and without the callback
+-- thunks (built with -DFFI_JIT, on x86-64), run this once with each build
+-- first on package.cpath (LUA_CPATH=/path/to/build/?.so lua callback_bench.lua).
+-- The ptr(T) case takes views, which always go through libFFI.
+local print=print
+local ffi = require('ffi')
+local libc = ffi.loadlib('libc.so', {
+  qsort = ffi.cif {ffi.pointer, ffi.size_t, ffi.size_t, ffi.pointer},
+})
+
+local N, ROUNDS = 100000, 10
+local data = ffi.alloc(ffi.sint, N)
+
+local function report(name, calls, t)
+  print(string.format("%-10s %8d calls %8.3f us/call", name, calls,
+    t / calls * 1e6))
+end
+
+local function bench(name, cif, cmp)
+  local calls = 0
+  local f = ffi.closure(cif, function(a, b)
+    calls = calls + 1
+    return cmp(a, b)
+  end)
+  local t = os.clock()
+  for r = 1, ROUNDS do
+    for i = 1, N do data[i] = (i * 7919 + r) % N end
+    libc.qsort(data, N, ffi.sizeof(ffi.sint), f)
+  end
+  report(name, calls, os.clock() - t)
+end
+
+-- untyped pointers, read with deref
+bench("pointer", ffi.cif {ret = ffi.sint; ffi.pointer, ffi.pointer},
+  function(a, b)
+    return ffi.deref(a, ffi.sint) - ffi.deref(b, ffi.sint)
+  end)
+
+-- typed pointers, received as views
+bench("ptr(T)", ffi.cif {ret = ffi.sint; ffi.ptr(ffi.sint), ffi.ptr(ffi.sint)},
+  function(a, b)
+    return a[1] - b[1]
+  end)
+
+-- scalar arguments and result, called back through a bound function
+do
+  local cif = ffi.cif {ret = ffi.sint16; ffi.sint, ffi.double, ffi.uint8}
+  local f = ffi.bind(cif, ffi.closure(cif, function(a, b, c)
+    return (a + c) % 1000
+  end))
+  local t = os.clock()
+  for i = 1, N * ROUNDS do f(i, 0.5, 1) end
+  report("scalar", N * ROUNDS, os.clock() - t)
+end
+
+-- vim: ts=2:sw=2:et
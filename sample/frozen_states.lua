@@ -0,0 +1,52 @@
+-- Declares a set of struct types and cifs the way one worker state would,
+-- either locally or by importing frozen ones, and reports what it costs
+-- the state.
+--
+-- usage (in each state): frozen_states.lua define|freeze|import
+--   define: declare everything in this state;
+--   freeze: declare everything, then freeze it under names (run once);
+--   import: import everything by name.
+-- To compare, run it in 32 states of one process: either "define" in all
+-- of them, or "freeze" in the first and "import" in the others, and compare
+-- the Lua heaps and the process RSS.
+local mode = ...
+local ffi = require('ffi')
+
+local NSTRUCTS, NFIELDS, NCIFS = 64, 12, 256
+local scalars = {ffi.sint8, ffi.uint16, ffi.sint, ffi.uint64, ffi.float,
+  ffi.double, ffi.pointer, ffi.size_t}
+
+local types, cifs = {}, {}
+local t = os.clock()
+if mode == "import" then
+  for i = 1, NSTRUCTS do types[i] = ffi.import("struct" .. i) end
+  for i = 1, NCIFS do cifs[i] = ffi.import("cif" .. i) end
+else
+  for i = 1, NSTRUCTS do
+    local fields = {}
+    for k = 1, NFIELDS do
+      fields[#fields+1] = (k == NFIELDS and i > 1) and types[i-1] or
+        scalars[(i + k) % #scalars + 1]
+      fields[#fields+1] = "field" .. k
+    end
+    types[i] = ffi.struct(fields)
+  end
+  for i = 1, NCIFS do
+    cifs[i] = ffi.cif {ret = scalars[i % #scalars + 1];
+      ffi.pointer, types[i % NSTRUCTS + 1], ffi.sint, ffi.double}
+  end
+  if mode == "freeze" then
+    for i = 1, NSTRUCTS do ffi.freeze(types[i], "struct" .. i) end
+    for i = 1, NCIFS do ffi.freeze(cifs[i], "cif" .. i) end
+  end
+end
+t = os.clock() - t
+assert(#types == NSTRUCTS and #cifs == NCIFS)
+
+collectgarbage()
+collectgarbage()
+print(string.format("%-6s %8.1f KiB Lua heap %8.3f ms", mode,
+  collectgarbage("count"), t * 1e3))
+return t, types, cifs
+
+-- vim: ts=2:sw=2:et
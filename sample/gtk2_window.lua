@@ -80,9 +80,10 @@ do
   local darea = gtk_drawing_area_new()
   gtk_widget_set_size_request(darea, 200, 200)
   local redraw = ffi.closure(
-    ffi.cif {ffi.pointer, ffi.pointer, ffi.pointer},
+    ffi.cif {ffi.ptr(GtkWidget), ffi.pointer, ffi.pointer},
     function(widget, event, ud)
-      local window = ffi.deref(widget, ffi.field(GtkWidget, "window"))
+      -- widget is a view of the GtkWidget, valid during the callback
+      local window = widget.window
       local width = ffi.deref(widget, ffi.field(GtkWidget, "allocation", "width"))
       local height = ffi.deref(widget, ffi.field(GtkWidget, "allocation", "height"))
       local cr = gdk_cairo_create(window)
@@ -0,0 +1,27 @@
+-- Times indexing an array object and ffi.typeof, which both check the
+-- kind of a userdata.  Reports the best of 5 runs per operation.
+local ffi = require('ffi')
+
+local N, ROUNDS = 1000, 20000
+local a = ffi.alloc(ffi.sint, N)
+
+local function bench(name, f)
+  local best = math.huge
+  for _ = 1, 5 do
+    local t = os.clock()
+    f()
+    best = math.min(best, os.clock() - t)
+  end
+  print(string.format("%-14s %8.1f ns/op", name, best / (N * ROUNDS) * 1e9))
+end
+
+bench("a[i] = a[i]+1", function()
+  for _ = 1, ROUNDS do for i = 1, N do a[i] = a[i] + 1 end end
+end)
+
+local typeof = ffi.typeof
+bench("ffi.typeof(a)", function()
+  for _ = 1, ROUNDS do for _ = 1, N do typeof(a) end end
+end)
+
+-- vim: ts=2:sw=2:et
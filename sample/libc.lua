@@ -12,6 +12,7 @@ local libc, div_t do
     memcpy = cif {ret = pointer; pointer, pointer, size_t},
     strcat = cif {ret = pointer; pointer, pointer},
     strlen = cif {ret = size_t; pointer},
+    dlsym = cif {ret = pointer; pointer, pointer},
   })
 end
 
@@ -30,6 +31,38 @@ do
 
   local r = div(7654321, 1234567)
   printf("%d %d\n", r.quot, r.rem)
+
+  -- reuse one object for struct returns
+  ffi.callinto(div, r, 100, 7)
+  printf("%d %d\n", r.quot, r.rem)
+
+  -- or get the fields as values, without an object
+  local divu = ffi.bind(ffi.cif {ret = div_t, unpack = true; ffi.sint, ffi.sint},
+    dlsym(nil, "div"))
+  local quot, rem = divu(100, 7)
+  printf("%d %d\n", quot, rem)
+
+  -- counters that may be shared with native threads
+  local counters = ffi.alloc(ffi.uint32, 2)
+  ffi.atomic_store(counters, 1, 41, "release")
+  print(ffi.atomic_add(counters, 1, 1), ffi.atomic_load(counters, 1, "acquire"))
+  print(ffi.atomic_cas(counters, 2, 0, 1))
+  ffi.atomic_store(counters, 2, 7)
+  print(ffi.atomic_exchange(counters, 2, 8), ffi.atomic_load(counters, 2))
+
+  -- iterate over an array of structs with one cursor
+  local results = ffi.alloc(div_t, 3)
+  for i, cur in ffi.each(results) do
+    cur.quot, cur.rem = i, -i
+  end
+  local cur = ffi.cursor(results)
+  while cur:next() do
+    printf("%d %d\n", cur.quot, cur.rem)
+  end
+
+  -- call a function pointer (nil is RTLD_DEFAULT on glibc)
+  local abs = ffi.bind(ffi.cif {ret = ffi.sint; ffi.sint}, dlsym(nil, "abs"))
+  printf("%d\n", abs(-42))
 end
 
 -- vim: ts=2:sw=2:et
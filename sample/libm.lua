@@ -37,4 +37,11 @@ for _, f in ipairs(complex_funcs) do
     f, libm.creal(x), libm.cimag(x), libm.creal(y), libm.cimag(y)))
 end
 
+-- cache the results of a pure function
+local sin = ffi.memoize(libm.sin, {capacity = 64})
+for i = 1, 1000 do
+  sin(i % 100)
+end
+print(sin, sin:stats())
+
 -- vim: ts=2:sw=2:et
@@ -0,0 +1,45 @@
+local print=print
+local ffi = require('ffi')
+local libc do
+  local _ENV=ffi
+  libc = loadlib('libc.so', {
+    memcpy = cif {ret = pointer; pointer, pointer, size_t},
+    strnlen = cif {ret = size_t; pointer, size_t},
+    memcmp = cif {ret = sint; pointer, pointer, size_t},
+  })
+end
+
+local CHUNK, N = 4096, 100000
+local chunk = ffi.alloc(ffi.char, CHUNK)
+local ref = ffi.alloc(ffi.char, CHUNK)
+for i = 1, CHUNK do
+  chunk[i] = 65 + i % 26
+  ref[i] = 65 + i % 26
+end
+
+-- copy the chunk, cut it at the first NUL, compare it with ref
+local buf = ffi.alloc(ffi.char, CHUNK)
+local pl = ffi.pipeline {
+  {libc.memcpy, ffi.output, ffi.input, ffi.inlen; out = buf},
+  {libc.strnlen, ffi.input, ffi.inlen; len = "ret"},
+  {libc.memcmp, ffi.input, ref, ffi.inlen},
+}
+print(pl, pl(chunk))
+
+local function bench(name, f)
+  local t = os.clock()
+  for _ = 1, N do f() end
+  print(string.format("%-10s %8.3f us/chunk", name,
+    (os.clock() - t) / N * 1e6))
+end
+
+bench("lua", function()
+  libc.memcpy(buf, chunk, CHUNK)
+  local len = libc.strnlen(buf, CHUNK)
+  return libc.memcmp(buf, ref, len)
+end)
+bench("pipeline", function()
+  return pl(chunk)
+end)
+
+-- vim: ts=2:sw=2:et
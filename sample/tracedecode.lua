@@ -0,0 +1,64 @@
+-- Decodes a trace written by ffi.tracedump.
+--
+-- usage: lua tracedecode.lua trace.bin [chrome]
+-- Prints a timeline, or Chrome trace JSON (for chrome://tracing) if the
+-- second argument is "chrome".
+
+local path, mode = ...
+assert(path, "usage: tracedecode.lua trace.bin [chrome]")
+local f = assert(io.open(path, "rb"))
+local data = f:read("a")
+f:close()
+
+local magic, nnames, nrecs, pos = string.unpack("=c8I4I4", data)
+assert(magic == "LFTRACE1", "not a trace file")
+
+local names = {}
+for _ = 1, nnames do
+  local addr, name
+  addr, name, pos = string.unpack("=I8s2", data, pos)
+  names[addr] = name
+end
+
+local KINDS = {[0] = "call", [1] = "callback"}
+local recs = {}
+for i = 1, nrecs do
+  local seq, fn, start, dur, thread, depth, kind
+  seq, fn, start, dur, thread, depth, kind, pos =
+    string.unpack("=I8I8I8I8I4I2I1x", data, pos)
+  recs[i] = {
+    name = names[fn] or string.format("0x%x", fn),
+    start = start, dur = dur, thread = thread, depth = depth,
+    kind = KINDS[kind] or "?",
+  }
+end
+table.sort(recs, function(a, b) return a.start < b.start end)
+
+-- JSON string literal; bytes are passed through, so names should be UTF-8
+local ESCAPES = {['"'] = '\\"', ['\\'] = '\\\\', ['\b'] = '\\b',
+  ['\f'] = '\\f', ['\n'] = '\\n', ['\r'] = '\\r', ['\t'] = '\\t'}
+local function json_string(s)
+  return '"' .. s:gsub('[%c"\\]', function(c)
+    return ESCAPES[c] or string.format("\\u%04x", c:byte())
+  end) .. '"'
+end
+
+if mode == "chrome" then
+  local out = {}
+  for i, r in ipairs(recs) do
+    out[i] = string.format(
+      '{"name":%s,"cat":%s,"ph":"X","ts":%.3f,"dur":%.3f,"pid":1,"tid":%d}',
+      json_string(r.name), json_string(r.kind), r.start / 1e3, r.dur / 1e3,
+      r.thread)
+  end
+  io.write("[", table.concat(out, ",\n"), "]\n")
+else
+  local t0 = recs[1] and recs[1].start or 0
+  for _, r in ipairs(recs) do
+    io.write(string.format("%12.3f us  T%-3d %s%-8s %s  %.3f us\n",
+      (r.start - t0) / 1e3, r.thread, string.rep("  ", r.depth),
+      r.kind, r.name, r.dur / 1e3))
+  end
+end
+
+-- vim: ts=2:sw=2:et